@@ -1,193 +1,1077 @@
-#include "Diff.h"
-#include <iostream>
-#include <vector>
-#include <unordered_map>
-#include <algorithm>
-#include <sstream>
-#include <climits>
-
-Diff::Diff(std::unique_ptr<Tokenizer> tokenizer,
-    const std::string& text1,
-    const std::string& text2,
-    const std::string oldName,
-    const std::string newName)
-    : tokenizer_(std::move(tokenizer)), oldName_(oldName), newName_(newName) {
-
-    from_tokens_ = tokenizer_->Encode(text1);
-    /* Token Check
-    for (const TokenId& token : from_tokens_) {
-        std::cout << tokenizer_->Decode({ token }) << ",";
-    }
-    std::cout << std::endl;
-    */
-    to_tokens_ = tokenizer_->Encode(text2);
-}
-
-std::vector<TokenId> Diff::HistLCS(int from_left, int from_right, int to_left, int to_right) {
-    // Skip equivalent items at top and bottom
-    std::vector<TokenId> hs, ts;
-    while (from_left < from_right && to_left < to_right && from_tokens_[from_left] == to_tokens_[to_left]) {
-        hs.push_back(from_tokens_[from_left]);
-        from_left++; to_left++;
-    }
-    while (from_left < from_right && to_left < to_right && from_tokens_[from_right - 1] == to_tokens_[to_right - 1]) {
-        ts.push_back(from_tokens_[from_right - 1]);
-        from_right--; to_right--;
-    }
-    reverse(ts.begin(), ts.end());
-
-    // Build histogram
-    struct Record {
-        int from_count = 0, from_i = -1, to_count = 0, to_i = -1;
-    };
-
-    std::unordered_map<int, Record> hist;
-    for (int i = from_left; i < from_right; i++) {
-        hist[from_tokens_[i]].from_count++;
-        hist[from_tokens_[i]].from_i = i;
-    }
-    for (int i = to_left; i < to_right; i++) {
-        hist[to_tokens_[i]].to_count++;
-        hist[to_tokens_[i]].to_i = i;
-    }
-
-    // Find lowest-occurrence item that appears in both
-    int cmp = INT_MAX;
-    int p = -1;
-    for (const auto& [key, rec] : hist) {
-        if (rec.from_count > 0 && rec.to_count > 0 && rec.from_count + rec.to_count < cmp) {
-            p = key;
-            cmp = rec.from_count + rec.to_count;
-        }
-    }
-
-    if (p == -1) {
-        hs.insert(hs.end(), ts.begin(), ts.end());
-        return hs;
-    }
-
-    Record rec = hist[p];
-    std::vector<TokenId> left = HistLCS(from_left, rec.from_i, to_left, rec.to_i);
-    std::vector<TokenId> right = HistLCS(rec.from_i + 1, from_right, rec.to_i + 1, to_right);
-
-    hs.insert(hs.end(), left.begin(), left.end());
-    hs.push_back(p);
-    hs.insert(hs.end(), right.begin(), right.end());
-    hs.insert(hs.end(), ts.begin(), ts.end());
-
-    return hs;
-}
-
-// Find the longest common subsequence (LCS)
-std::vector<TokenId> Diff::LCS(DiffFormat format) {
-    switch (format) {
-        case DiffFormat::HISTOGRAM:
-            return Diff::HistLCS(0, from_tokens_.size(), 0, to_tokens_.size());
-        case DiffFormat::PATIENCE:
-            return Diff::HistLCS(0, from_tokens_.size(), 0, to_tokens_.size()); // TO DO:   Patience
-        default:
-            return Diff::HistLCS(0, from_tokens_.size(), 0, to_tokens_.size());
-    }
-}
-
-void Diff::AddHunk(std::vector<Hunk>& hunks, int f_start, int f_end, int t_start, int t_end, bool has_prev, bool has_next) {
-    Hunk hunk;
-    int context_before = 0;
-    int context_after = 0;
-
-    if (has_prev && f_start > 0) {
-        hunk.lines.push_back(" " + tokenizer_->Decode({ from_tokens_[f_start - 1] }));
-        context_before = 1;
-    }
-    for (int f = f_start; f < f_end; f++) {
-        hunk.lines.push_back("-" + tokenizer_->Decode({ from_tokens_[f] }));
-    }
-    for (int t = t_start; t < t_end; t++) {
-        hunk.lines.push_back("+" + tokenizer_->Decode({ to_tokens_[t] }));
-    }
-
-    if (has_next && f_end < from_tokens_.size()) {
-        hunk.lines.push_back(" " + tokenizer_->Decode({ from_tokens_[f_end] }));
-        context_after = 1;
-    }
-
-    hunk.f_start = f_start - context_before + 1;
-    hunk.t_start = t_start - context_before + 1;
-    hunk.f_count = (f_end - f_start) + context_before + context_after;
-    hunk.t_count = (t_end - t_start) + context_before + context_after;
-    if (context_before > 0) {
-        hunk.f_start -= context_before;
-        hunk.t_start -= context_before;
-    }
-    hunks.push_back(hunk);
- };
-
-std::string Diff::GetDiff(DiffFormat format) {
-    std::vector<TokenId> lcs = Diff::LCS(format);
-    /* LCS Check
-    for (const TokenId& token : lcs) {
-        std::cout << tokenizer_->Decode({ token }) << ",";
-    }
-    std::cout << std::endl;
-    */
-    std::vector<int> from_pos, to_pos;
-    int i = 0, j = 0;
-    for (const TokenId& token : lcs) {
-        while (i < from_tokens_.size() && from_tokens_[i] != token) i++;
-        if (i >= from_tokens_.size()) return "";
-        from_pos.push_back(i);
-        i++;
-        while (j < to_tokens_.size() && to_tokens_[j] != token) j++;
-        if (j >= to_tokens_.size()) return "";
-        to_pos.push_back(j);
-        j++;
-    }
-
-    std::vector<Hunk> hunks;
-    int prev_f = 0, prev_t = 0;
-
-    for (size_t k = 0; k <= lcs.size(); k++) {
-        int curr_f = (k < from_pos.size()) ? from_pos[k] : from_tokens_.size();
-        int curr_t = (k < to_pos.size()) ? to_pos[k] : to_tokens_.size();
-
-        int f_start = prev_f;
-        int f_end = curr_f;
-        int t_start = prev_t;
-        int t_end = curr_t;
-
-        if (f_start < f_end || t_start < t_end) {
-            bool has_prev = (k > 0);
-            bool has_next = (k < from_pos.size());
-
-            AddHunk(hunks, f_start, f_end, t_start, t_end, has_prev, has_next);
-        }
-
-        prev_f = curr_f + 1;
-        prev_t = curr_t + 1;
-    }
-
-    std::stringstream diff;
-    diff << "--- " << oldName_ << "\n";
-    diff << "+++ " << newName_ << "\n";
-    for (const Hunk& hunk : hunks) {
-        diff << "@@ -" << hunk.f_start << "," << hunk.f_count << " +" << hunk.t_start << "," << hunk.t_count << " @@\n";
-        for (const std::string& line : hunk.lines) {
-            diff << line << "\n";
-        }
-    }
-
-    return diff.str();
-}
-
-bool Diff::Identical() const {
-    if (from_tokens_.size() != to_tokens_.size()) {
-        return false;
-    }
-    for (size_t i = 0; i < from_tokens_.size(); ++i) {
-        if (from_tokens_[i] != to_tokens_[i]) {
-            return false;
-        }
-    }
-
-    return true;
-}
+#include "Diff.h"
+#include "EditScript.h"
+#include "Simd.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <climits>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
+#include <exception>
+
+#ifdef _WIN32
+#include <io.h>
+#define WRITE_FD _write
+#else
+#include <unistd.h>
+#define WRITE_FD ::write
+#endif
+
+namespace {
+
+void AppendNumber(std::string& out, int value) {
+    char digits[16];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+// Escapes text as the inside of a JSON string, spans that need no escaping
+// are copied whole. Bytes that do not start a well-formed UTF-8 sequence,
+// as byte mode tokens may hold, are written as the code point of their value
+void AppendJson(std::string& out, std::string_view text) {
+    static const char hex[] = "0123456789abcdef";
+
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        auto c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            continue;
+        }
+        if (c >= 0xC0) {
+            size_t length = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+            if (length <= text.size() - i && Utf8Validate(text.data() + i, length) == length) {
+                i += length - 1;
+                continue;
+            }
+        }
+
+        out.append(text.data() + start, i - start);
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xF];
+        }
+        start = i + 1;
+    }
+    out.append(text.data() + start, text.size() - start);
+}
+
+}
+
+Diff::Diff(std::unique_ptr<Tokenizer> tokenizer,
+    const std::string& text1,
+    const std::string& text2,
+    const std::string oldName,
+    const std::string newName,
+    const DiffOptions& options)
+    : tokenizer_(std::move(tokenizer)), oldName_(oldName), newName_(newName), options_(options) {
+
+    // Identical texts, the most common pair, are found on raw bytes and never
+    // tokenized; the whole text is the equal tail and its tokens are only
+    // counted if asked for. It is copied like any equal tail, LCS and
+    // GetEditScript still have to encode it
+    if (text1.size() == text2.size() && CommonPrefix(text1.data(), text2.data(), text1.size()) == text1.size()) {
+        CheckEqualText(text1, 0);
+        tail_ = text1;
+        return;
+    }
+
+    // Equal lines at the top and bottom are found on raw bytes and never
+    // tokenized, except for the lines kept next to the change as context
+    size_t head = 0, tail = 0;
+    EqualLines(text1, text2, std::max(options_.context, 0), head, tail);
+    head_ = text1.substr(0, head);
+    tail_ = text1.substr(text1.size() - tail);
+    CheckEqualText(head_, 0);
+    base_ = tokenizer_->CountTokens(head_);
+
+    from_tokens_ = EncodeText(std::string_view(text1).substr(head, text1.size() - head - tail), head, oldName_);
+    CheckEqualText(tail_, text1.size() - tail);
+    /* Token Check
+    for (const TokenId& token : from_tokens_) {
+        std::cout << tokenizer_->Decode({ token }) << ",";
+    }
+    std::cout << std::endl;
+    */
+    to_tokens_ = EncodeText(std::string_view(text2).substr(head, text2.size() - head - tail), head, newName_);
+}
+
+// Tokens never cross line breaks, so large texts are cut after one into
+// pieces that the workers encode at once against the shared vocabulary.
+// Offsets of malformed text are reported in the whole file
+std::vector<TokenId> Diff::EncodeText(std::string_view text, size_t offset, const std::string& name) {
+    try {
+        if (options_.threads <= 1 || text.size() <= kEncodePiece) {
+            return tokenizer_->Encode(text);
+        }
+
+        std::vector<size_t> starts = { 0 };
+        for (size_t cut = text.find('\n', kEncodePiece); cut != std::string_view::npos && cut + 1 < text.size();
+            cut = text.find('\n', cut + 1 + kEncodePiece)) {
+            starts.push_back(cut + 1);
+        }
+        starts.push_back(text.size());
+
+        size_t pieces = starts.size() - 1;
+        std::vector<std::vector<TokenId>> tokens(pieces);
+        std::vector<std::exception_ptr> errors(pieces);
+        if (!pool_) {
+            pool_ = std::make_unique<ThreadPool>(options_.threads);
+        }
+        for (size_t i = 0; i < pieces; i++) {
+            pool_->Submit([this, text, i, &starts, &tokens, &errors] {
+                try {
+                    tokens[i] = tokenizer_->Encode(text.substr(starts[i], starts[i + 1] - starts[i]));
+                }
+                catch (const Utf8Error& e) {
+                    errors[i] = std::make_exception_ptr(Utf8Error(starts[i] + e.Offset()));
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        pool_->Wait();
+
+        // The first bad piece holds the first bad byte
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        size_t total = 0;
+        for (const auto& piece : tokens) {
+            total += piece.size();
+        }
+        std::vector<TokenId> result;
+        result.reserve(total);
+        for (const auto& piece : tokens) {
+            result.insert(result.end(), piece.begin(), piece.end());
+        }
+        return result;
+    }
+    catch (const Utf8Error& e) {
+        throw Utf8Error(offset + e.Offset(), name);
+    }
+}
+
+// Text equal in both files is checked as Encode would check it, malformed
+// bytes are reported in the old file
+void Diff::CheckEqualText(std::string_view text, size_t offset) const {
+    try {
+        tokenizer_->CheckUtf8(text);
+    }
+    catch (const Utf8Error& e) {
+        throw Utf8Error(offset + e.Offset(), oldName_);
+    }
+}
+
+// Lengths of the equal head and tail of both texts, cut at line boundaries
+// so that tokens never cross them, with context non-blank lines left out
+void Diff::EqualLines(const std::string& text1, const std::string& text2, int context, size_t& head, size_t& tail) {
+    size_t n = std::min(text1.size(), text2.size());
+    size_t prefix = CommonPrefix(text1.data(), text2.data(), n);
+    size_t suffix = CommonSuffix(text1.data() + text1.size(), text2.data() + text2.size(), n - prefix);
+
+    auto blank = [&text1](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+            if (!std::isspace(static_cast<unsigned char>(text1[i]))) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    if (prefix == text1.size() && prefix == text2.size()) {
+        head = prefix;
+        tail = 0;
+        return;
+    }
+
+    head = prefix;
+    while (head > 0 && text1[head - 1] != '\n') {
+        head--;
+    }
+    for (int lines = 0; head > 0 && lines < context; ) {
+        size_t start = head - 1;
+        while (start > 0 && text1[start - 1] != '\n') {
+            start--;
+        }
+        if (!blank(start, head)) {
+            lines++;
+        }
+        head = start;
+    }
+
+    // The line break before the tail has to be equal as well
+    tail = suffix;
+    while (tail > 0 && (tail == suffix || text1[text1.size() - tail - 1] != '\n')) {
+        tail--;
+    }
+    for (int lines = 0; tail > 0 && lines < context; ) {
+        size_t start = text1.size() - tail;
+        size_t end = text1.find('\n', start);
+        end = (end == std::string::npos) ? text1.size() : end + 1;
+        if (!blank(start, end)) {
+            lines++;
+        }
+        tail -= end - start;
+    }
+}
+
+void Diff::BuildHistogram(Workspace& ws, int from_left, int from_right, int to_left, int to_right) {
+    // Entries are remembered in touched in order of first occurrence,
+    // so only they have to be reset afterwards
+    for (int i = from_left; i < from_right; i++) {
+        Record& rec = ws.hist[from_tokens_[i]];
+        if (rec.from_count == 0) {
+            ws.touched.push_back(from_tokens_[i]);
+        }
+        rec.from_count++;
+        rec.from_i = i;
+    }
+    for (int i = to_left; i < to_right; i++) {
+        Record& rec = ws.hist[to_tokens_[i]];
+        if (rec.from_count == 0) {
+            continue; // can never be an anchor
+        }
+        rec.to_count++;
+        rec.to_i = i;
+    }
+}
+
+void Diff::ClearHistogram(Workspace& ws) {
+    for (TokenId key : ws.touched) {
+        ws.hist[key] = Record();
+    }
+    ws.touched.clear();
+}
+
+// Find lowest-occurrence item that appears in both, returns its occurrence
+// count or 0 if there is none. Items occurring more than max_chain_length
+// times on the old side are left out and counted in skipped
+int Diff::HistAnchor(const Workspace& ws, TokenMatch& anchor, int& skipped) const {
+    int cmp = INT_MAX;
+    for (TokenId key : ws.touched) {
+        const Record& rec = ws.hist[key];
+        if (rec.to_count == 0) {
+            continue;
+        }
+        if (options_.max_chain_length > 0 && rec.from_count > options_.max_chain_length) {
+            skipped++;
+            continue;
+        }
+        if (rec.from_count + rec.to_count < cmp) {
+            anchor = { rec.from_i, rec.to_i };
+            cmp = rec.from_count + rec.to_count;
+        }
+    }
+
+    return (cmp != INT_MAX) ? cmp : 0;
+}
+
+// Longest increasing subsequence of items that are unique on both sides
+void Diff::PatienceAnchors(Workspace& ws, std::vector<TokenMatch>& anchors) {
+    // touched is in old side order, so unique items come sorted by from_i
+    anchors.clear();
+    for (TokenId key : ws.touched) {
+        const Record& rec = ws.hist[key];
+        if (rec.from_count == 1 && rec.to_count == 1) {
+            anchors.push_back({ rec.from_i, rec.to_i });
+        }
+    }
+    if (anchors.empty()) {
+        return;
+    }
+
+    // Patience sorting by to_pos: piles keeps the top of every pile,
+    // links the top of the previous pile at the time an item was placed
+    ws.piles.clear();
+    ws.links.resize(anchors.size());
+    for (int k = 0; k < static_cast<int>(anchors.size()); k++) {
+        auto pile = std::lower_bound(ws.piles.begin(), ws.piles.end(), anchors[k].to_pos,
+            [&anchors](int top, int to_pos) { return anchors[top].to_pos < to_pos; });
+        ws.links[k] = (pile == ws.piles.begin()) ? -1 : *(pile - 1);
+        if (pile == ws.piles.end()) {
+            ws.piles.push_back(k);
+        }
+        else {
+            *pile = k;
+        }
+    }
+
+    // Walk back from the last pile to collect the chain, then compact it
+    // in place: the chain indices grow at least as fast as their slots
+    int count = ws.piles.size();
+    for (int n = count - 1, k = ws.piles.back(); n >= 0; n--) {
+        ws.piles[n] = k;
+        k = ws.links[k];
+    }
+    for (int n = 0; n < count; n++) {
+        anchors[n] = anchors[ws.piles[n]];
+    }
+    anchors.resize(count);
+}
+
+// Middle snake of the shortest edit path, Myers' linear space variant.
+// start..finish is one edit step followed or preceded by a diagonal
+bool Diff::MiddleSnake(Workspace& ws, int from_left, int from_right, int to_left, int to_right, TokenMatch& start, TokenMatch& finish) {
+    int width = from_right - from_left;
+    int height = to_right - to_left;
+    int delta = width - height;
+    int max = (width + height + 1) / 2;
+    if (max == 0) {
+        return false;
+    }
+
+    // vf holds the furthest x on diagonal k, vb the smallest y on
+    // diagonal c of the reverse search, both shifted by max
+    ws.myers_forward.assign(2 * max + 2, 0);
+    ws.myers_backward.assign(2 * max + 2, 0);
+    int* vf = ws.myers_forward.data() + max;
+    int* vb = ws.myers_backward.data() + max;
+    vf[1] = from_left;
+    vb[1] = to_right;
+
+    for (int d = 0; d <= max; d++) {
+        for (int k = d; k >= -d; k -= 2) {
+            int c = k - delta;
+            int x, px;
+            if (k == -d || (k != d && vf[k - 1] < vf[k + 1])) {
+                px = x = vf[k + 1];
+            }
+            else {
+                px = vf[k - 1];
+                x = px + 1;
+            }
+            int y = to_left + (x - from_left) - k;
+            int py = (d == 0 || x != px) ? y : y - 1;
+            while (x < from_right && y < to_right && from_tokens_[x] == to_tokens_[y]) {
+                x++; y++;
+            }
+            vf[k] = x;
+            if ((delta & 1) && c >= -(d - 1) && c <= d - 1 && y >= vb[c]) {
+                start = { px, py };
+                finish = { x, y };
+                return true;
+            }
+        }
+
+        for (int c = d; c >= -d; c -= 2) {
+            int k = c + delta;
+            int y, py;
+            if (c == -d || (c != d && vb[c - 1] > vb[c + 1])) {
+                py = y = vb[c + 1];
+            }
+            else {
+                py = vb[c - 1];
+                y = py - 1;
+            }
+            int x = from_left + (y - to_left) + k;
+            int px = (d == 0 || y != py) ? x : x + 1;
+            while (x > from_left && y > to_left && from_tokens_[x - 1] == to_tokens_[y - 1]) {
+                x--; y--;
+            }
+            vb[c] = y;
+            if (!(delta & 1) && k >= -d && k <= d && x <= vf[k]) {
+                start = { x, y };
+                finish = { px, py };
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void Diff::RangeLCS(Workspace& ws, DiffFormat format, int from_left, int from_right, int to_left, int to_right, Segment& out, bool spawn) {
+    std::vector<TokenMatch>& matches = out.matches;
+
+    // Sub-ranges are taken from an explicit stack in output order,
+    // so every match is appended to matches as soon as it is found
+    struct Frame {
+        int from_left, from_right, to_left, to_right;
+        DiffFormat format;
+        bool equal; // range is already known to match, only copy it out
+    };
+
+    std::vector<Frame> stack;
+    stack.push_back({ from_left, from_right, to_left, to_right, format, false });
+    bool first = true;
+
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+
+        if (frame.equal) {
+            for (int i = 0; i < frame.from_right - frame.from_left; i++) {
+                matches.push_back({ frame.from_left + i, frame.to_left + i });
+            }
+            continue;
+        }
+
+        // Large independent ranges go to other workers, their output is
+        // spliced in at the current position once all tasks are done
+        int size = (frame.from_right - frame.from_left) + (frame.to_right - frame.to_left);
+        if (spawn && !first && size > options_.parallel_threshold) {
+            out.children.emplace_back(matches.size(), std::make_unique<Segment>());
+            Segment* child = out.children.back().second.get();
+            pool_->Submit([this, child, frame] {
+                RangeLCS(workspaces_[ThreadPool::CurrentWorker()], frame.format,
+                    frame.from_left, frame.from_right, frame.to_left, frame.to_right, *child, true);
+            });
+            continue;
+        }
+        first = false;
+
+        from_left = frame.from_left; from_right = frame.from_right;
+        to_left = frame.to_left; to_right = frame.to_right;
+        ws.stats.ranges++;
+
+        // Skip equivalent items at top and bottom
+        while (from_left < from_right && to_left < to_right && from_tokens_[from_left] == to_tokens_[to_left]) {
+            matches.push_back({ from_left, to_left });
+            from_left++; to_left++;
+        }
+        while (from_left < from_right && to_left < to_right && from_tokens_[from_right - 1] == to_tokens_[to_right - 1]) {
+            from_right--; to_right--;
+        }
+        if (from_right < frame.from_right) {
+            stack.push_back({ from_right, frame.from_right, to_right, frame.to_right, frame.format, true });
+        }
+
+        if (frame.format == DiffFormat::MYERS) {
+            TokenMatch start, finish;
+            if (from_left == from_right || to_left == to_right ||
+                !MiddleSnake(ws, from_left, from_right, to_left, to_right, start, finish)) {
+                continue;
+            }
+            // The snake is one edit next to a diagonal and is always smaller
+            // than the trimmed range, its own prefix/suffix skip resolves it
+            stack.push_back({ finish.from_pos, from_right, finish.to_pos, to_right, frame.format, false });
+            stack.push_back({ start.from_pos, finish.from_pos, start.to_pos, finish.to_pos, frame.format, false });
+            stack.push_back({ from_left, start.from_pos, to_left, start.to_pos, frame.format, false });
+            continue;
+        }
+
+        BuildHistogram(ws, from_left, from_right, to_left, to_right);
+
+        // Every range below starts at its anchor: the prefix skip emits
+        // the anchor and then goes on exactly as a range after it would
+        if (frame.format == DiffFormat::PATIENCE) {
+            PatienceAnchors(ws, ws.anchors);
+            if (!ws.anchors.empty()) {
+                ClearHistogram(ws);
+                for (int k = ws.anchors.size() - 1; k >= 0; k--) {
+                    int f_end = (k + 1 < static_cast<int>(ws.anchors.size())) ? ws.anchors[k + 1].from_pos : from_right;
+                    int t_end = (k + 1 < static_cast<int>(ws.anchors.size())) ? ws.anchors[k + 1].to_pos : to_right;
+                    stack.push_back({ ws.anchors[k].from_pos, f_end, ws.anchors[k].to_pos, t_end, frame.format, false });
+                }
+                stack.push_back({ from_left, ws.anchors[0].from_pos, to_left, ws.anchors[0].to_pos, frame.format, false });
+                continue;
+            }
+            // No unique items in this range, fall back to the histogram anchor
+        }
+
+        TokenMatch anchor;
+        int skipped = 0;
+        int occurrences = HistAnchor(ws, anchor, skipped);
+        ClearHistogram(ws);
+        ws.stats.chain_limited += skipped;
+
+        if (occurrences == 0 && skipped == 0) {
+            continue;
+        }
+
+        // Every common item is over the chain limit, or even the rarest one is
+        // so common that anchors would barely split the range
+        if (occurrences == 0 || (options_.myers_fallback > 0 && occurrences > options_.myers_fallback)) {
+            ws.stats.myers_fallbacks++;
+            stack.push_back({ from_left, from_right, to_left, to_right, DiffFormat::MYERS, false });
+            continue;
+        }
+
+        stack.push_back({ anchor.from_pos, from_right, anchor.to_pos, to_right, frame.format, false });
+        stack.push_back({ from_left, anchor.from_pos, to_left, anchor.to_pos, frame.format, false });
+    }
+}
+
+// Sparse order-preserving anchors that cut both token lists into chunks
+// of about chunk_size tokens: the patience chain over the whole input
+void Diff::ChunkCuts(Workspace& ws, std::vector<TokenMatch>& cuts) {
+    BuildHistogram(ws, 0, from_tokens_.size(), 0, to_tokens_.size());
+    PatienceAnchors(ws, ws.anchors);
+    ClearHistogram(ws);
+
+    int last_f = 0, last_t = 0;
+    for (const TokenMatch& anchor : ws.anchors) {
+        if ((anchor.from_pos - last_f) + (anchor.to_pos - last_t) >= options_.chunk_size) {
+            cuts.push_back(anchor);
+            last_f = anchor.from_pos;
+            last_t = anchor.to_pos;
+        }
+    }
+}
+
+// Find matching token positions of the longest common subsequence (LCS)
+std::vector<TokenMatch> Diff::Matches(DiffFormat format) {
+    if (format != DiffFormat::PATIENCE && format != DiffFormat::MYERS) {
+        format = DiffFormat::HISTOGRAM;
+    }
+
+    bool parallel = options_.threads > 1;
+    if (parallel && !pool_) {
+        pool_ = std::make_unique<ThreadPool>(options_.threads);
+    }
+    workspaces_.resize(parallel ? pool_->Size() : 1);
+
+    if (workspaces_[0].hist.empty()) {
+        TokenId max_id = 0;
+        for (TokenId token : from_tokens_) max_id = std::max(max_id, token);
+        for (TokenId token : to_tokens_) max_id = std::max(max_id, token);
+        for (Workspace& ws : workspaces_) {
+            ws.hist.resize(static_cast<size_t>(max_id) + 1);
+        }
+    }
+    for (Workspace& ws : workspaces_) {
+        ws.stats = DiffStats();
+    }
+
+    // Huge inputs are first cut at globally unique anchors, every chunk
+    // is then diffed on its own with a working set that fits in cache
+    std::vector<TokenMatch> cuts;
+    if (options_.chunk_size > 0 && from_tokens_.size() + to_tokens_.size() > 2 * static_cast<size_t>(options_.chunk_size)) {
+        ChunkCuts(workspaces_[0], cuts);
+    }
+
+    Segment root;
+    if (!cuts.empty()) {
+        for (size_t k = 0; k <= cuts.size(); k++) {
+            // Every chunk but the first starts at its anchor
+            int from_left = (k > 0) ? cuts[k - 1].from_pos : 0;
+            int to_left = (k > 0) ? cuts[k - 1].to_pos : 0;
+            int from_right = (k < cuts.size()) ? cuts[k].from_pos : from_tokens_.size();
+            int to_right = (k < cuts.size()) ? cuts[k].to_pos : to_tokens_.size();
+
+            root.children.emplace_back(0, std::make_unique<Segment>());
+            Segment* chunk = root.children.back().second.get();
+            if (parallel) {
+                pool_->Submit([this, chunk, format, from_left, from_right, to_left, to_right] {
+                    RangeLCS(workspaces_[ThreadPool::CurrentWorker()], format, from_left, from_right, to_left, to_right, *chunk, true);
+                });
+            }
+            else {
+                RangeLCS(workspaces_[0], format, from_left, from_right, to_left, to_right, *chunk, false);
+            }
+        }
+        if (parallel) {
+            pool_->Wait();
+        }
+    }
+    else if (parallel) {
+        pool_->Submit([this, &root, format] {
+            RangeLCS(workspaces_[ThreadPool::CurrentWorker()], format, 0, from_tokens_.size(), 0, to_tokens_.size(), root, true);
+        });
+        pool_->Wait();
+    }
+    else {
+        root.matches.reserve(std::min(from_tokens_.size(), to_tokens_.size()));
+        RangeLCS(workspaces_[0], format, 0, from_tokens_.size(), 0, to_tokens_.size(), root, false);
+    }
+
+    stats_ = DiffStats();
+    for (const Workspace& ws : workspaces_) {
+        stats_.ranges += ws.stats.ranges;
+        stats_.chain_limited += ws.stats.chain_limited;
+        stats_.myers_fallbacks += ws.stats.myers_fallbacks;
+    }
+
+    if (root.children.empty()) {
+        CountEdits(root.matches.size());
+        return std::move(root.matches);
+    }
+
+    // Splice the task outputs together in order
+    std::vector<TokenMatch> matches;
+    matches.reserve(std::min(from_tokens_.size(), to_tokens_.size()));
+
+    struct Cursor {
+        const Segment* segment;
+        size_t match, child;
+    };
+    std::vector<Cursor> cursors;
+    cursors.push_back({ &root, 0, 0 });
+    while (!cursors.empty()) {
+        Cursor& cursor = cursors.back();
+        const Segment& segment = *cursor.segment;
+        if (cursor.child < segment.children.size() && segment.children[cursor.child].first == cursor.match) {
+            cursors.push_back({ segment.children[cursor.child++].second.get(), 0, 0 });
+            continue;
+        }
+        if (cursor.match == segment.matches.size()) {
+            cursors.pop_back();
+            continue;
+        }
+
+        size_t end = (cursor.child < segment.children.size()) ? segment.children[cursor.child].first : segment.matches.size();
+        matches.insert(matches.end(), segment.matches.begin() + cursor.match, segment.matches.begin() + end);
+        cursor.match = end;
+    }
+
+    CountEdits(matches.size());
+    return matches;
+}
+
+void Diff::CountEdits(size_t matched) {
+    stats_.removed = from_tokens_.size() - matched;
+    stats_.added = to_tokens_.size() - matched;
+    stats_.kept = matched + base_ + TailTokens();
+}
+
+// Counted on first use, the equal tail is never tokenized otherwise
+size_t Diff::TailTokens() const {
+    if (tail_tokens_ < 0) {
+        tail_tokens_ = tokenizer_->CountTokens(tail_);
+    }
+    return tail_tokens_;
+}
+
+// Find the longest common subsequence (LCS)
+std::vector<TokenId> Diff::LCS(DiffFormat format) {
+    std::vector<TokenMatch> matches = Diff::Matches(format);
+
+    // The equal head and tail are tokenized only on request
+    std::vector<TokenId> lcs = tokenizer_->Encode(head_);
+    lcs.reserve(lcs.size() + matches.size());
+    for (const TokenMatch& match : matches) {
+        lcs.push_back(from_tokens_[match.from_pos]);
+    }
+    std::vector<TokenId> tail = tokenizer_->Encode(tail_);
+    lcs.insert(lcs.end(), tail.begin(), tail.end());
+
+    return lcs;
+}
+
+std::vector<EditLine> Diff::GetEditScript(DiffFormat format) {
+    std::vector<TokenMatch> matches = Diff::Matches(format);
+    std::vector<TokenId> head = tokenizer_->Encode(head_);
+    std::vector<TokenId> tail = tokenizer_->Encode(tail_);
+
+    std::vector<EditLine> script;
+    script.reserve(head.size() + from_tokens_.size() + to_tokens_.size() - matches.size() + tail.size());
+
+    for (int i = 0; i < static_cast<int>(head.size()); i++) {
+        script.push_back({ ' ', head[i], i, i });
+    }
+
+    int f = 0, t = 0;
+    for (size_t k = 0; k <= matches.size(); k++) {
+        int curr_f = (k < matches.size()) ? matches[k].from_pos : from_tokens_.size();
+        int curr_t = (k < matches.size()) ? matches[k].to_pos : to_tokens_.size();
+
+        for (; f < curr_f; f++) {
+            script.push_back({ '-', from_tokens_[f], base_ + f, -1 });
+        }
+        for (; t < curr_t; t++) {
+            script.push_back({ '+', to_tokens_[t], -1, base_ + t });
+        }
+        if (k < matches.size()) {
+            script.push_back({ ' ', from_tokens_[f], base_ + f, base_ + t });
+            f++; t++;
+        }
+    }
+
+    for (int i = 0; i < static_cast<int>(tail.size()); i++) {
+        script.push_back({ ' ', tail[i], base_ + f + i, base_ + t + i });
+    }
+
+    return script;
+}
+
+// Single pass over the gaps between matches, a change whose context window
+// overlaps or touches the open hunk is added to it instead of starting a new one
+void Diff::BuildHunks(const std::vector<TokenMatch>& matches, const std::function<void(const Hunk&)>& emit) const {
+    const int context = std::max(options_.context, 0);
+    const int f_size = from_tokens_.size();
+    const int t_size = to_tokens_.size();
+
+    auto finish = [this, &emit](Hunk& hunk) {
+        hunk.f_count = hunk.f_end - hunk.f_begin;
+        hunk.t_count = hunk.t_end - hunk.t_begin;
+        // An empty side starts at the line before it, as in diff -u
+        hunk.f_start = base_ + hunk.f_begin + (hunk.f_count > 0 ? 1 : 0);
+        hunk.t_start = base_ + hunk.t_begin + (hunk.t_count > 0 ? 1 : 0);
+        emit(hunk);
+    };
+
+    Hunk hunk;
+    bool open = false;
+    int prev_f = 0, prev_t = 0;
+
+    for (size_t k = 0; k <= matches.size(); k++) {
+        int f_end = (k < matches.size()) ? matches[k].from_pos : f_size;
+        int t_end = (k < matches.size()) ? matches[k].to_pos : t_size;
+
+        if (prev_f < f_end || prev_t < t_end) {
+            if (!open || prev_f - context > hunk.f_end) {
+                if (open) {
+                    finish(hunk);
+                }
+
+                // Matches before the change are context, both sides have the same run of them
+                int before = std::min(context, std::min(prev_f, prev_t));
+                hunk.f_begin = prev_f - before;
+                hunk.t_begin = prev_t - before;
+                hunk.match = k - before;
+                open = true;
+            }
+
+            hunk.f_end = std::min(f_end + context, f_size);
+            hunk.t_end = std::min(t_end + context, t_size);
+        }
+
+        prev_f = f_end + 1;
+        prev_t = t_end + 1;
+    }
+
+    if (open) {
+        finish(hunk);
+    }
+}
+
+// Visits the tokens of a hunk in output order: deletions and insertions of
+// every gap, with the matches between them as context
+template <typename Emit>
+void Diff::WalkHunk(const Hunk& hunk, const std::vector<TokenMatch>& matches, Emit&& emit) const {
+    int f = hunk.f_begin, t = hunk.t_begin;
+    for (size_t k = hunk.match; ; k++) {
+        bool inside = k < matches.size() && matches[k].from_pos < hunk.f_end;
+        int next_f = inside ? matches[k].from_pos : hunk.f_end;
+        int next_t = inside ? matches[k].to_pos : hunk.t_end;
+
+        for (; f < next_f; f++) {
+            emit('-', from_tokens_[f]);
+        }
+        for (; t < next_t; t++) {
+            emit('+', to_tokens_[t]);
+        }
+        if (!inside) {
+            break;
+        }
+
+        emit(' ', from_tokens_[f]);
+        f++; t++;
+    }
+}
+
+void Diff::RenderHunk(const Hunk& hunk, const std::vector<TokenMatch>& matches, std::string& buffer) const {
+    buffer += "@@ -";
+    AppendNumber(buffer, hunk.f_start);
+    buffer += ',';
+    AppendNumber(buffer, hunk.f_count);
+    buffer += " +";
+    AppendNumber(buffer, hunk.t_start);
+    buffer += ',';
+    AppendNumber(buffer, hunk.t_count);
+    buffer += " @@\n";
+
+    // Token text is appended straight from the vocabulary, a line costs no allocation
+    // once the buffer has grown to its working size
+    const Tokenizer& tokenizer = *tokenizer_;
+    WalkHunk(hunk, matches, [&tokenizer, &buffer](char type, TokenId token) {
+        buffer += type;
+        buffer += tokenizer.TokenText(token);
+        buffer += '\n';
+    });
+}
+
+// {"from":{"start":S,"count":C},"to":{...},"ops":[{"op":"delete","text":"..."},...]}
+// with tokens of the same kind joined into one op
+void Diff::RenderJson(const Hunk& hunk, const std::vector<TokenMatch>& matches, std::string& buffer) const {
+    buffer += "{\"from\":{\"start\":";
+    AppendNumber(buffer, hunk.f_start);
+    buffer += ",\"count\":";
+    AppendNumber(buffer, hunk.f_count);
+    buffer += "},\"to\":{\"start\":";
+    AppendNumber(buffer, hunk.t_start);
+    buffer += ",\"count\":";
+    AppendNumber(buffer, hunk.t_count);
+    buffer += "},\"ops\":[";
+
+    const Tokenizer& tokenizer = *tokenizer_;
+    char run = 0;
+    WalkHunk(hunk, matches, [&tokenizer, &buffer, &run](char type, TokenId token) {
+        if (type != run) {
+            if (run != 0) {
+                buffer += "\"},";
+            }
+            buffer += (type == '-') ? "{\"op\":\"delete\",\"text\":\"" :
+                (type == '+') ? "{\"op\":\"insert\",\"text\":\"" : "{\"op\":\"context\",\"text\":\"";
+            run = type;
+        }
+        AppendJson(buffer, tokenizer.TokenText(token));
+    });
+    if (run != 0) {
+        buffer += "\"}";
+    }
+
+    buffer += "]}\n";
+}
+
+// Hunks are rendered as soon as they are built, through one buffer that is
+// handed to flush whenever it fills up
+void Diff::Render(DiffFormat format, OutputFormat output, const std::function<void(const std::string&)>& flush) {
+    std::vector<TokenMatch> matches = Diff::Matches(format);
+
+    std::string buffer;
+    if (output == OutputFormat::BINARY) {
+        RenderScript(matches, buffer);
+        flush(buffer);
+        return;
+    }
+
+    buffer.reserve(kWriteBuffer + kWriteBuffer / 4);
+    if (output == OutputFormat::UNIFIED) {
+        buffer += "--- " + oldName_ + "\n";
+        buffer += "+++ " + newName_ + "\n";
+    }
+
+    BuildHunks(matches, [&](const Hunk& hunk) {
+        if (output == OutputFormat::NDJSON) {
+            RenderJson(hunk, matches, buffer);
+        }
+        else {
+            RenderHunk(hunk, matches, buffer);
+        }
+        if (buffer.size() >= kWriteBuffer) {
+            flush(buffer);
+            buffer.clear();
+        }
+    });
+
+    if (!buffer.empty()) {
+        flush(buffer);
+    }
+}
+
+// The binary script covers the whole texts, equal head and tail lines
+// included, so it can be applied to the old file as it is
+void Diff::RenderScript(const std::vector<TokenMatch>& matches, std::string& buffer) const {
+    const bool with_text = options_.script_text;
+    EditScriptWriter writer(with_text);
+
+    auto bytes = [this, with_text](const std::vector<TokenId>& tokens, int begin, int end) {
+        size_t size = 0;
+        for (int i = begin; with_text && i < end; i++) {
+            size += tokenizer_->TokenText(tokens[i]).size();
+        }
+        return size;
+    };
+
+    writer.Copy(base_, head_.size());
+
+    std::string text;
+    int prev_f = 0, prev_t = 0;
+    for (size_t k = 0; k <= matches.size(); k++) {
+        int f_end = (k < matches.size()) ? matches[k].from_pos : from_tokens_.size();
+        int t_end = (k < matches.size()) ? matches[k].to_pos : to_tokens_.size();
+
+        writer.Delete(f_end - prev_f, bytes(from_tokens_, prev_f, f_end));
+        if (t_end > prev_t) {
+            text.clear();
+            if (with_text) {
+                tokenizer_->DecodeInto(to_tokens_.data() + prev_t, t_end - prev_t, text);
+            }
+            writer.Insert(t_end - prev_t, text);
+        }
+        if (k < matches.size()) {
+            writer.Copy(1, bytes(from_tokens_, f_end, f_end + 1));
+        }
+
+        prev_f = f_end + 1;
+        prev_t = t_end + 1;
+    }
+
+    writer.Copy(TailTokens(), tail_.size());
+    writer.Finish(buffer);
+}
+
+std::string Diff::GetDiff(DiffFormat format, OutputFormat output) {
+    std::string diff;
+    Render(format, output, [&diff](const std::string& chunk) {
+        diff += chunk;
+    });
+
+    return diff;
+}
+
+void Diff::WriteDiff(std::ostream& out, DiffFormat format, OutputFormat output) {
+    Render(format, output, [&out](const std::string& chunk) {
+        out.write(chunk.data(), chunk.size());
+    });
+}
+
+bool Diff::WriteDiff(int fd, DiffFormat format, OutputFormat output) {
+    bool ok = true;
+    Render(format, output, [fd, &ok](const std::string& chunk) {
+        size_t written = 0;
+        while (ok && written < chunk.size()) {
+            auto n = WRITE_FD(fd, chunk.data() + written, static_cast<unsigned>(chunk.size() - written));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+    });
+
+    return ok;
+}
+
+// Line-level hunks whose changed lines are diffed again word by word,
+// and optionally character by character inside replaced words
+std::string Diff::GetRefinedDiff(DiffFormat format, RefineLevel level) {
+    std::vector<TokenMatch> matches = Diff::Matches(format);
+
+    auto context = [this](int f) {
+        std::string line = " ";
+        line += tokenizer_->TokenText(from_tokens_[f]);
+        if (line.back() != '\n') {
+            line += "\n";
+        }
+        return line;
+    };
+
+    std::stringstream diff;
+    diff << "--- " << oldName_ << "\n";
+    diff << "+++ " << newName_ << "\n";
+
+    BuildHunks(matches, [&](const Hunk& hunk) {
+        diff << "@@ -" << hunk.f_start << "," << hunk.f_count << " +" << hunk.t_start << "," << hunk.t_count << " @@\n";
+
+        int f = hunk.f_begin, t = hunk.t_begin;
+        for (size_t k = hunk.match; ; k++) {
+            bool inside = k < matches.size() && matches[k].from_pos < hunk.f_end;
+            int next_f = inside ? matches[k].from_pos : hunk.f_end;
+            int next_t = inside ? matches[k].to_pos : hunk.t_end;
+
+            if (f < next_f || t < next_t) {
+                std::string from_text, to_text;
+                tokenizer_->DecodeInto(from_tokens_.data() + f, next_f - f, from_text);
+                tokenizer_->DecodeInto(to_tokens_.data() + t, next_t - t, to_text);
+                // Changed lines are marked with '!' as in the context diff format
+                std::string change = RefineChange(from_text, to_text, format, level);
+                size_t start = 0;
+                do {
+                    size_t end = change.find('\n', start);
+                    end = (end == std::string::npos) ? change.length() : end + 1;
+                    diff << "!" << change.substr(start, end - start);
+                    start = end;
+                } while (start < change.length());
+                if (change.empty() || change.back() != '\n') {
+                    diff << "\n";
+                }
+                f = next_f;
+                t = next_t;
+            }
+            if (!inside) {
+                break;
+            }
+
+            diff << context(f);
+            f++; t++;
+        }
+    });
+
+    return diff.str();
+}
+
+// Only the changed region is tokenized again, so the work depends on
+// the size of the change and not on the size of the texts
+std::string Diff::RefineChange(const std::string& from_text, const std::string& to_text, DiffFormat format, RefineLevel level) const {
+    // Changed regions are small, they never pay for a thread pool
+    DiffOptions options = options_;
+    options.threads = 1;
+
+    Diff words(CreateTokenizer(TokenizerMode::WORD), from_text, to_text, oldName_, newName_, options);
+    return words.Markup(words.GetEditScript(format), format, level);
+}
+
+// Renders an edit script inline, deletions as [-text-] and insertions as {+text+}
+std::string Diff::Markup(const std::vector<EditLine>& script, DiffFormat format, RefineLevel level) const {
+    std::string result;
+
+    for (size_t k = 0; k < script.size(); ) {
+        if (script[k].type == ' ') {
+            result += tokenizer_->TokenText(script[k].content);
+            k++;
+            continue;
+        }
+
+        // Every change is a run of deletions followed by a run of insertions
+        size_t del_end = k;
+        while (del_end < script.size() && script[del_end].type == '-') del_end++;
+        size_t ins_end = del_end;
+        while (ins_end < script.size() && script[ins_end].type == '+') ins_end++;
+
+        std::vector<TokenId> deleted, inserted;
+        for (size_t n = k; n < del_end; n++) deleted.push_back(script[n].content);
+        for (size_t n = del_end; n < ins_end; n++) inserted.push_back(script[n].content);
+
+        if (level == RefineLevel::CHARACTER && deleted.size() == inserted.size()) {
+            // Replaced word pairs are refined character by character
+            for (size_t n = 0; n < deleted.size(); n++) {
+                Diff chars(CreateTokenizer(TokenizerMode::CHARACTER),
+                    std::string(tokenizer_->TokenText(deleted[n])), std::string(tokenizer_->TokenText(inserted[n])), oldName_, newName_, options_);
+                result += chars.Markup(chars.GetEditScript(format), format, RefineLevel::WORD);
+            }
+        }
+        else {
+            if (!deleted.empty()) {
+                result += "[-" + tokenizer_->Decode(deleted) + "-]";
+            }
+            if (!inserted.empty()) {
+                result += "{+" + tokenizer_->Decode(inserted) + "+}";
+            }
+        }
+
+        k = ins_end;
+    }
+
+    return result;
+}
+
+const DiffStats& Diff::GetStats() const {
+    return stats_;
+}
+
+// Runs the engine for the counts alone, no token is decoded and no hunk is built
+DiffStats Diff::GetStats(DiffFormat format) {
+    Diff::Matches(format);
+    return stats_;
+}
+
+bool Diff::Identical() const {
+    if (from_tokens_.size() != to_tokens_.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < from_tokens_.size(); ++i) {
+        if (from_tokens_[i] != to_tokens_[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
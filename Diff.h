@@ -1,50 +1,194 @@
-#pragma once
-
-#include "Tokenizer.h"
-#include <vector>
-#include <utility>
-#include <stdexcept>
-
-enum class DiffFormat {
-    HISTOGRAM,
-    PATIENCE
-};
-
-struct EditLine {
-    char type; // '-' for deletion, '+' for insertion, ' ' for common
-    TokenId content;
-    int original_line;
-    int modified_line;
-};
-
-struct Hunk {
-    int f_start, f_count;
-    int t_start, t_count;
-    std::vector<std::string> lines;
-};
-
-class Diff {
-public:
-
-    Diff(std::unique_ptr<Tokenizer> tokenizer,
-        const std::string& text1,
-        const std::string& text2,
-        const std::string oldName,
-        const std::string newName);
-
-    std::vector<TokenId> LCS(DiffFormat format);
-    std::string GetDiff(DiffFormat format = DiffFormat::HISTOGRAM);
-
-    bool Identical() const;
-
-private:
-    std::vector<TokenId> HistLCS(int from_left, int from_right, int to_left, int to_right);
-    void AddHunk(std::vector<Hunk>& hunks, int f_start, int f_end, int t_start, int t_end, bool has_prev, bool has_next);
-
-    std::unique_ptr<Tokenizer> tokenizer_;
-
-    std::vector<TokenId> from_tokens_;
-    std::vector<TokenId> to_tokens_;
-    std::string oldName_;
-    std::string newName_;
+#pragma once
+
+#include "Tokenizer.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+#include <ostream>
+
+enum class DiffFormat {
+    HISTOGRAM,
+    PATIENCE,
+    MYERS
+};
+
+// Layout GetDiff and WriteDiff produce
+enum class OutputFormat {
+    UNIFIED,
+    NDJSON, // one JSON object per hunk, one per line; bytes that are not
+            // UTF-8 are written as \u00XX of their value
+    BINARY  // edit script, see EditScript.h
+};
+
+// Finer granularity the changed regions of a diff are diffed again with
+enum class RefineLevel {
+    WORD,
+    CHARACTER
+};
+
+struct DiffOptions {
+    // Histogram ranges whose rarest common item occurs more often than this
+    // (both sides together) are diffed with Myers instead, 0 disables
+    int myers_fallback = 64;
+    // Items occurring more often than this on the old side of a range are
+    // never chosen as histogram anchors, 0 disables
+    int max_chain_length = 64;
+    // Worker threads of the diff engine and of tokenization, 1 runs both on
+    // the calling thread
+    int threads = 1;
+    // Ranges with more tokens than this (both sides together) are split off
+    // as tasks when threads > 1, the result does not depend on it
+    int parallel_threshold = 4096;
+    // Inputs with more than twice this many tokens are cut into chunks of
+    // about this size at tokens unique on both sides, 0 disables
+    int chunk_size = 0;
+    // Unchanged tokens shown around each change, changes closer than twice
+    // this share one hunk
+    int context = 1;
+    // BINARY output carries byte lengths and inserted text, needed to apply it
+    bool script_text = true;
+};
+
+// Work done by the last run of the diff engine
+struct DiffStats {
+    size_t ranges = 0;          // ranges the engine had to split
+    size_t chain_limited = 0;   // anchor candidates skipped by max_chain_length
+    size_t myers_fallbacks = 0; // histogram ranges handed over to Myers
+    // Tokens of the result, equal head and tail lines included
+    size_t added = 0;
+    size_t removed = 0;
+    size_t kept = 0;
+};
+
+struct EditLine {
+    char type; // '-' for deletion, '+' for insertion, ' ' for common
+    TokenId content;
+    int original_line; // 0-based token position, -1 for insertions
+    int modified_line; // 0-based token position, -1 for deletions
+};
+
+// Pair of equal tokens matched by the diff engine
+struct TokenMatch {
+    int from_pos;
+    int to_pos;
+};
+
+struct Hunk {
+    int f_start, f_count;
+    int t_start, t_count;
+    // Tokens covered by the hunk, context included, and the first match among them
+    int f_begin, f_end;
+    int t_begin, t_end;
+    size_t match;
+};
+
+class Diff {
+public:
+
+    // Throws Utf8Error naming the file if a text is not valid UTF-8, equal
+    // lines that are never tokenized included
+    Diff(std::unique_ptr<Tokenizer> tokenizer,
+        const std::string& text1,
+        const std::string& text2,
+        const std::string oldName = "old",
+        const std::string newName = "new",
+        const DiffOptions& options = DiffOptions());
+
+    std::vector<TokenId> LCS(DiffFormat format);
+    std::vector<EditLine> GetEditScript(DiffFormat format = DiffFormat::HISTOGRAM);
+    std::string GetDiff(DiffFormat format = DiffFormat::HISTOGRAM, OutputFormat output = OutputFormat::UNIFIED);
+    void WriteDiff(std::ostream& out, DiffFormat format = DiffFormat::HISTOGRAM, OutputFormat output = OutputFormat::UNIFIED);
+    bool WriteDiff(int fd, DiffFormat format = DiffFormat::HISTOGRAM, OutputFormat output = OutputFormat::UNIFIED);
+    std::string GetRefinedDiff(DiffFormat format = DiffFormat::HISTOGRAM, RefineLevel level = RefineLevel::WORD);
+
+    const DiffStats& GetStats() const;
+    DiffStats GetStats(DiffFormat format);
+
+    bool Identical() const;
+
+private:
+    // Occurrences of one token inside the current range
+    struct Record {
+        int from_count = 0, from_i = -1, to_count = 0, to_i = -1;
+    };
+
+    // Scratch space of one engine thread
+    struct Workspace {
+        // Histogram indexed by TokenId, shared by all ranges of this diff
+        std::vector<Record> hist;
+        std::vector<TokenId> touched;
+
+        // Patience anchor search
+        std::vector<TokenMatch> anchors;
+        std::vector<int> piles;
+        std::vector<int> links;
+
+        // Myers middle snake search
+        std::vector<int> myers_forward;
+        std::vector<int> myers_backward;
+
+        DiffStats stats;
+    };
+
+    // Output of one engine task, the outputs of the tasks it spawned
+    // go before matches[position]
+    struct Segment {
+        std::vector<TokenMatch> matches;
+        std::vector<std::pair<size_t, std::unique_ptr<Segment>>> children;
+    };
+
+    static void EqualLines(const std::string& text1, const std::string& text2, int context, size_t& head, size_t& tail);
+
+    std::vector<TokenId> EncodeText(std::string_view text, size_t offset, const std::string& name);
+    void CheckEqualText(std::string_view text, size_t offset) const;
+    std::vector<TokenMatch> Matches(DiffFormat format);
+    void CountEdits(size_t matched);
+    size_t TailTokens() const;
+    void ChunkCuts(Workspace& ws, std::vector<TokenMatch>& cuts);
+    void RangeLCS(Workspace& ws, DiffFormat format, int from_left, int from_right, int to_left, int to_right, Segment& out, bool spawn);
+
+    void BuildHistogram(Workspace& ws, int from_left, int from_right, int to_left, int to_right);
+    void ClearHistogram(Workspace& ws);
+    int HistAnchor(const Workspace& ws, TokenMatch& anchor, int& skipped) const;
+    void PatienceAnchors(Workspace& ws, std::vector<TokenMatch>& anchors);
+    bool MiddleSnake(Workspace& ws, int from_left, int from_right, int to_left, int to_right, TokenMatch& start, TokenMatch& finish);
+    void BuildHunks(const std::vector<TokenMatch>& matches, const std::function<void(const Hunk&)>& emit) const;
+    template <typename Emit>
+    void WalkHunk(const Hunk& hunk, const std::vector<TokenMatch>& matches, Emit&& emit) const;
+    void RenderHunk(const Hunk& hunk, const std::vector<TokenMatch>& matches, std::string& buffer) const;
+    void RenderJson(const Hunk& hunk, const std::vector<TokenMatch>& matches, std::string& buffer) const;
+    void Render(DiffFormat format, OutputFormat output, const std::function<void(const std::string&)>& flush);
+    void RenderScript(const std::vector<TokenMatch>& matches, std::string& buffer) const;
+    std::string RefineChange(const std::string& from_text, const std::string& to_text, DiffFormat format, RefineLevel level) const;
+    std::string Markup(const std::vector<EditLine>& script, DiffFormat format, RefineLevel level) const;
+
+    std::unique_ptr<Tokenizer> tokenizer_;
+
+    // Only the text between the equal head and tail lines is tokenized,
+    // positions of from_tokens_ and to_tokens_ start at base_. The equal
+    // text is kept as a copy, at most one more old text in all: LCS and
+    // GetEditScript return its tokens and the texts passed in need not
+    // outlive the Diff, so lengths and counts alone would not do
+    std::string head_;
+    std::string tail_;
+    int base_ = 0;
+    mutable long tail_tokens_ = -1;
+
+    std::vector<TokenId> from_tokens_;
+    std::vector<TokenId> to_tokens_;
+
+    // One workspace per engine thread
+    std::vector<Workspace> workspaces_;
+    std::unique_ptr<ThreadPool> pool_;
+
+    static constexpr size_t kWriteBuffer = 1 << 16;
+    // Texts larger than this are encoded in pieces on the pool when threads > 1
+    static constexpr size_t kEncodePiece = 1 << 20;
+
+    std::string oldName_;
+    std::string newName_;
+    DiffOptions options_;
+    DiffStats stats_;
 };
\ No newline at end of file
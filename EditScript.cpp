@@ -0,0 +1,214 @@
+#include "EditScript.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+void PutVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+void PutFixed(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+uint64_t GetFixed(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+}
+
+EditScriptWriter::EditScriptWriter(bool with_text)
+    : with_text_(with_text) {
+}
+
+void EditScriptWriter::Copy(uint64_t tokens, uint64_t bytes) {
+    Add(EditKind::COPY, tokens, bytes);
+}
+
+void EditScriptWriter::Delete(uint64_t tokens, uint64_t bytes) {
+    Add(EditKind::DELETE, tokens, bytes);
+}
+
+void EditScriptWriter::Insert(uint64_t tokens, std::string_view text) {
+    Add(EditKind::INSERT, tokens, text.size());
+    if (with_text_) {
+        text_ += text;
+    }
+}
+
+void EditScriptWriter::Add(EditKind kind, uint64_t tokens, uint64_t bytes) {
+    if (tokens == 0) {
+        return;
+    }
+    if (tokens_ > 0 && kind != kind_) {
+        Flush();
+    }
+
+    kind_ = kind;
+    tokens_ += tokens;
+    bytes_ += bytes;
+
+    if (kind != EditKind::INSERT) {
+        from_tokens_ += tokens;
+    }
+    if (kind != EditKind::DELETE) {
+        to_tokens_ += tokens;
+    }
+}
+
+void EditScriptWriter::Flush() {
+    PutVarint(ops_, tokens_ << 2 | static_cast<uint64_t>(kind_));
+    if (with_text_) {
+        PutVarint(ops_, bytes_);
+    }
+    op_count_++;
+
+    tokens_ = 0;
+    bytes_ = 0;
+}
+
+void EditScriptWriter::Finish(std::string& out) {
+    if (tokens_ > 0) {
+        Flush();
+    }
+
+    out.reserve(out.size() + edit_script::kHeaderSize + ops_.size() + text_.size());
+    out.append(edit_script::kMagic, sizeof(edit_script::kMagic));
+    PutFixed(out, edit_script::kVersion, 2);
+    PutFixed(out, with_text_ ? edit_script::kHasText : 0, 2);
+    PutFixed(out, from_tokens_, 8);
+    PutFixed(out, to_tokens_, 8);
+    PutFixed(out, op_count_, 8);
+    PutFixed(out, ops_.size(), 8);
+    PutFixed(out, text_.size(), 8);
+    out += ops_;
+    out += text_;
+}
+
+EditScriptReader::EditScriptReader(std::string_view data) {
+    Parse(data);
+}
+
+EditScriptReader EditScriptReader::Open(const std::string& file_path) {
+    auto file = std::make_unique<MappedFile>(file_path);
+    EditScriptReader reader(file->Data());
+    reader.file_ = std::move(file);
+    return reader;
+}
+
+void EditScriptReader::Parse(std::string_view data) {
+    if (data.size() < edit_script::kHeaderSize || std::memcmp(data.data(), edit_script::kMagic, sizeof(edit_script::kMagic)) != 0) {
+        throw std::runtime_error("Not an edit script");
+    }
+
+    const char* header = data.data();
+    version_ = static_cast<uint16_t>(GetFixed(header + 4, 2));
+    flags_ = static_cast<uint16_t>(GetFixed(header + 6, 2));
+    if (version_ == 0 || version_ > edit_script::kVersion) {
+        throw std::runtime_error("Unsupported edit script version " + std::to_string(version_));
+    }
+
+    from_tokens_ = GetFixed(header + 8, 8);
+    to_tokens_ = GetFixed(header + 16, 8);
+    op_count_ = GetFixed(header + 24, 8);
+    uint64_t ops_size = GetFixed(header + 32, 8);
+    uint64_t text_size = GetFixed(header + 40, 8);
+
+    uint64_t body = data.size() - edit_script::kHeaderSize;
+    if (ops_size > body || text_size > body - ops_size) {
+        throw std::runtime_error("Truncated edit script");
+    }
+
+    ops_ = data.substr(edit_script::kHeaderSize, ops_size);
+    text_ = data.substr(edit_script::kHeaderSize + ops_size, text_size);
+}
+
+uint16_t EditScriptReader::GetVersion() const {
+    return version_;
+}
+
+bool EditScriptReader::HasText() const {
+    return (flags_ & edit_script::kHasText) != 0;
+}
+
+uint64_t EditScriptReader::FromTokens() const {
+    return from_tokens_;
+}
+
+uint64_t EditScriptReader::ToTokens() const {
+    return to_tokens_;
+}
+
+uint64_t EditScriptReader::OpCount() const {
+    return op_count_;
+}
+
+uint64_t EditScriptReader::ReadVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (op_cursor_ >= ops_.size()) {
+            throw std::runtime_error("Truncated edit script");
+        }
+        auto byte = static_cast<unsigned char>(ops_[op_cursor_++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Malformed varint in edit script");
+}
+
+bool EditScriptReader::Next(EditOp& op) {
+    if (ops_read_ == op_count_) {
+        return false;
+    }
+
+    uint64_t run = ReadVarint();
+    if ((run & 3) > static_cast<uint64_t>(EditKind::INSERT)) {
+        throw std::runtime_error("Unknown edit script operation");
+    }
+
+    op.kind = static_cast<EditKind>(run & 3);
+    op.tokens = run >> 2;
+    op.bytes = HasText() ? ReadVarint() : 0;
+    op.from_pos = from_pos_;
+    op.to_pos = to_pos_;
+    op.text = std::string_view();
+
+    if (op.kind == EditKind::INSERT && HasText()) {
+        if (op.bytes > text_.size() - text_cursor_) {
+            throw std::runtime_error("Truncated edit script");
+        }
+        op.text = text_.substr(text_cursor_, op.bytes);
+        text_cursor_ += op.bytes;
+    }
+
+    if (op.kind != EditKind::INSERT) {
+        from_pos_ += op.tokens;
+    }
+    if (op.kind != EditKind::DELETE) {
+        to_pos_ += op.tokens;
+    }
+    ops_read_++;
+
+    return true;
+}
+
+void EditScriptReader::Rewind() {
+    op_cursor_ = 0;
+    text_cursor_ = 0;
+    ops_read_ = 0;
+    from_pos_ = 0;
+    to_pos_ = 0;
+}
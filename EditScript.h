@@ -0,0 +1,107 @@
+#pragma once
+
+#include "MappedFile.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Binary edit script, integers are little endian
+//
+//   header  magic "EDSC", u16 version, u16 flags, u64 from_tokens, u64 to_tokens,
+//           u64 op_count, u64 ops_size, u64 text_size
+//   ops     op_count varints (tokens << 2 | kind), one per run of copied, deleted
+//           or inserted tokens; with HAS_TEXT each is followed by the varint byte
+//           length of the run's text on its own side
+//   text    with HAS_TEXT, the text of every insertion back to back
+//
+// Runs come in edit order, so token positions follow from the run lengths
+
+enum class EditKind : uint8_t { COPY = 0, DELETE = 1, INSERT = 2 };
+
+struct EditOp {
+    EditKind kind;
+    uint64_t tokens;
+    uint64_t bytes;        // byte length of the run, 0 without HAS_TEXT
+    uint64_t from_pos;     // token positions where the run starts
+    uint64_t to_pos;
+    std::string_view text; // inserted text, empty for other runs or without HAS_TEXT
+};
+
+namespace edit_script {
+
+constexpr char kMagic[4] = { 'E', 'D', 'S', 'C' };
+constexpr uint16_t kVersion = 1;
+constexpr uint16_t kHasText = 1;
+constexpr size_t kHeaderSize = 48;
+
+}
+
+// Collects runs and lays them out in the binary format, adjacent runs
+// of the same kind are merged
+class EditScriptWriter {
+public:
+    explicit EditScriptWriter(bool with_text);
+
+    void Copy(uint64_t tokens, uint64_t bytes);
+    void Delete(uint64_t tokens, uint64_t bytes);
+    void Insert(uint64_t tokens, std::string_view text);
+
+    // Appends the whole script to out
+    void Finish(std::string& out);
+
+private:
+    void Add(EditKind kind, uint64_t tokens, uint64_t bytes);
+    void Flush();
+
+    bool with_text_;
+    EditKind kind_ = EditKind::COPY;
+    uint64_t tokens_ = 0;
+    uint64_t bytes_ = 0;
+
+    uint64_t from_tokens_ = 0;
+    uint64_t to_tokens_ = 0;
+    uint64_t op_count_ = 0;
+    std::string ops_;
+    std::string text_;
+};
+
+// Walks a binary edit script in place, over a caller's buffer or a mapped file
+class EditScriptReader {
+public:
+    // Both throw std::runtime_error on data that is not a supported edit script,
+    // the data has to outlive the reader
+    explicit EditScriptReader(std::string_view data);
+    // Maps the file, the reader keeps the mapping
+    static EditScriptReader Open(const std::string& file_path);
+
+    uint16_t GetVersion() const;
+    bool HasText() const;
+    uint64_t FromTokens() const;
+    uint64_t ToTokens() const;
+    uint64_t OpCount() const;
+
+    // Next run in edit order, false after the last one
+    bool Next(EditOp& op);
+    void Rewind();
+
+private:
+    void Parse(std::string_view data);
+    uint64_t ReadVarint();
+
+    std::unique_ptr<MappedFile> file_;
+
+    uint16_t version_ = 0;
+    uint16_t flags_ = 0;
+    uint64_t from_tokens_ = 0;
+    uint64_t to_tokens_ = 0;
+    uint64_t op_count_ = 0;
+    std::string_view ops_;
+    std::string_view text_;
+
+    size_t op_cursor_ = 0;
+    size_t text_cursor_ = 0;
+    uint64_t ops_read_ = 0;
+    uint64_t from_pos_ = 0;
+    uint64_t to_pos_ = 0;
+};
@@ -0,0 +1,65 @@
+#include "MappedFile.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& file_path) {
+#ifndef _WIN32
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open file " + file_path);
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ == 0) {
+            ::close(fd);
+            return;
+        }
+
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Can't map file " + file_path);
+        }
+        // Files are read front to back
+        ::madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(data);
+        return;
+    }
+    ::close(fd);
+    size_ = 0;
+#endif
+
+    // Pipes and platforms without mmap are read whole
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Can't open file " + file_path);
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    buffer_ = contents.str();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (data_ != nullptr) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+std::string_view MappedFile::Data() const {
+    if (data_ != nullptr) {
+        return std::string_view(data_, size_);
+    }
+    return buffer_;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Read-only view of a whole file, mapped into memory where the platform
+// allows it and read into a buffer otherwise
+class MappedFile {
+public:
+    // Throws std::runtime_error if the file can not be opened or mapped
+    explicit MappedFile(const std::string& file_path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view Data() const;
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string buffer_; // contents when the file is not mapped
+};
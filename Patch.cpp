@@ -0,0 +1,378 @@
+#include "Patch.h"
+#include "EditScript.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// "-A,B" or "+A,B" at the front of text
+bool ParseRange(std::string_view& text, char sign, long& start, long& count) {
+    if (text.empty() || text[0] != sign) {
+        return false;
+    }
+    const char* end = text.data() + text.size();
+    auto first = std::from_chars(text.data() + 1, end, start);
+    if (first.ec != std::errc() || first.ptr == end || *first.ptr != ',') {
+        return false;
+    }
+    auto second = std::from_chars(first.ptr + 1, end, count);
+    if (second.ec != std::errc()) {
+        return false;
+    }
+    text.remove_prefix(second.ptr - text.data());
+    return true;
+}
+
+class StringSink {
+public:
+    StringSink(std::string_view old_text, std::string& out)
+        : old_text_(old_text), out_(out) {
+    }
+
+    void Copy(size_t offset, size_t length) {
+        out_.append(old_text_.data() + offset, length);
+    }
+
+    void Write(std::string_view text) {
+        out_ += text;
+    }
+
+private:
+    std::string_view old_text_;
+    std::string& out_;
+};
+
+#ifndef _WIN32
+// Small pieces are gathered in a buffer, large unchanged blocks go from
+// file to file without passing through user space where the kernel can
+class FileSink {
+public:
+    FileSink(int in_fd, int out_fd, std::string_view old_text)
+        : in_fd_(in_fd), out_fd_(out_fd), old_text_(old_text) {
+        buffer_.reserve(kBuffer);
+    }
+
+    void Copy(size_t offset, size_t length) {
+        if (length < kBuffer) {
+            Write(old_text_.substr(offset, length));
+            return;
+        }
+
+        Flush();
+#ifdef __linux__
+        loff_t in_offset = static_cast<loff_t>(offset);
+        while (length > 0 && in_fd_ >= 0) {
+            ssize_t copied = ::copy_file_range(in_fd_, &in_offset, out_fd_, nullptr, length, 0);
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            if (copied <= 0) {
+                // Not supported between these files, the rest is written from the mapping
+                break;
+            }
+            offset += copied;
+            length -= copied;
+        }
+#endif
+        WriteAll(old_text_.data() + offset, length);
+    }
+
+    void Write(std::string_view text) {
+        buffer_ += text;
+        if (buffer_.size() >= kBuffer) {
+            Flush();
+        }
+    }
+
+    void Flush() {
+        WriteAll(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    void WriteAll(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = ::write(out_fd_, data, length);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                throw std::runtime_error(std::string("Can't write patched file: ") + std::strerror(errno));
+            }
+            data += written;
+            length -= written;
+        }
+    }
+
+    static constexpr size_t kBuffer = 1 << 16;
+
+    int in_fd_;
+    int out_fd_;
+    std::string_view old_text_;
+    std::string buffer_;
+};
+#endif
+
+}
+
+Patch Patch::Parse(std::string_view diff) {
+    Patch patch;
+    if (diff.size() >= sizeof(edit_script::kMagic) && std::memcmp(diff.data(), edit_script::kMagic, sizeof(edit_script::kMagic)) == 0) {
+        ParseScript(diff, patch);
+    }
+    else {
+        ParseUnified(diff, patch);
+    }
+    return patch;
+}
+
+// Every hunk line is a prefix and one token. Tokens ending in a line break
+// are rendered with it, which leaves an empty line after them
+void Patch::ParseUnified(std::string_view diff, Patch& patch) {
+    size_t pos = 0;
+    auto next_line = [&diff, &pos](std::string_view& line) {
+        if (pos >= diff.size()) {
+            return false;
+        }
+        size_t end = diff.find('\n', pos);
+        end = (end == std::string_view::npos) ? diff.size() : end;
+        line = diff.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
+
+    // Anything before the file names is not part of the diff
+    std::string_view line;
+    bool names = false;
+    while (!names && next_line(line)) {
+        if (line.rfind("--- ", 0) == 0) {
+            names = next_line(line) && line.rfind("+++ ", 0) == 0;
+            if (!names) {
+                throw std::runtime_error("Unified diff without new file name");
+            }
+        }
+    }
+    if (!names) {
+        throw std::runtime_error("No unified diff header");
+    }
+
+    long f_count = 0, t_count = 0, f_seen = 0, t_seen = 0;
+    auto finish = [&]() {
+        if (!patch.edits_.empty() && (f_seen != f_count || t_seen != t_count)) {
+            throw std::runtime_error("Hunk line counts do not match its header");
+        }
+    };
+
+    while (next_line(line)) {
+        if (line.rfind("@@ ", 0) == 0) {
+            finish();
+
+            long f_start = 0, t_start = 0;
+            std::string_view ranges = line.substr(3);
+            bool valid = ParseRange(ranges, '-', f_start, f_count);
+            if (valid && ranges.size() > 1) {
+                ranges.remove_prefix(1);
+                valid = ParseRange(ranges, '+', t_start, t_count);
+            }
+            if (!valid || ranges != " @@") {
+                throw std::runtime_error("Malformed hunk header");
+            }
+
+            Edit edit;
+            // An empty side names the token before it
+            edit.old_token = (f_count > 0) ? f_start - 1 : f_start;
+            edit.old_tokens = f_count;
+            edit.at_start = (f_start == 0);
+            patch.edits_.push_back(std::move(edit));
+            f_seen = t_seen = 0;
+            continue;
+        }
+
+        if (patch.edits_.empty() || line.empty() || (line[0] != ' ' && line[0] != '-' && line[0] != '+')) {
+            throw std::runtime_error("Malformed hunk line");
+        }
+
+        Edit& edit = patch.edits_.back();
+        bool line_break = pos < diff.size() && diff[pos] == '\n';
+        if (line_break) {
+            pos++;
+        }
+
+        if (line[0] != '+') {
+            edit.old_text.append(line.data() + 1, line.size() - 1);
+            if (line_break) {
+                edit.old_text += '\n';
+            }
+            f_seen++;
+        }
+        if (line[0] != '-') {
+            edit.new_text.append(line.data() + 1, line.size() - 1);
+            if (line_break) {
+                edit.new_text += '\n';
+            }
+            t_seen++;
+        }
+    }
+    finish();
+}
+
+// Deletions and insertions next to each other become one edit at a known offset
+void Patch::ParseScript(std::string_view script, Patch& patch) {
+    EditScriptReader reader(script);
+    if (!reader.HasText()) {
+        throw std::runtime_error("Edit script without text can not be applied");
+    }
+
+    size_t offset = 0;
+    EditOp op;
+    while (reader.Next(op)) {
+        if (op.kind == EditKind::COPY) {
+            offset += op.bytes;
+            continue;
+        }
+
+        bool adjacent = !patch.edits_.empty() &&
+            patch.edits_.back().old_offset + patch.edits_.back().old_length == offset;
+        if (!adjacent) {
+            Edit edit;
+            edit.located = true;
+            edit.old_offset = offset;
+            patch.edits_.push_back(std::move(edit));
+        }
+
+        Edit& edit = patch.edits_.back();
+        if (op.kind == EditKind::DELETE) {
+            edit.old_length += op.bytes;
+            offset += op.bytes;
+        }
+        else {
+            edit.new_text += op.text;
+        }
+    }
+
+    patch.has_size_ = true;
+    patch.old_size_ = offset;
+}
+
+template <typename Sink>
+void Patch::Run(std::string_view old_text, Sink& sink, const Tokenizer* tokenizer) const {
+    if (has_size_ && old_size_ != old_text.size()) {
+        throw std::runtime_error("Patch does not fit the old text");
+    }
+
+    size_t cursor = 0;
+    size_t cursor_token = 0;
+    for (const Edit& edit : edits_) {
+        size_t offset = edit.old_offset;
+        size_t length = edit.old_length;
+
+        if (!edit.located) {
+            length = edit.old_text.size();
+
+            if (tokenizer != nullptr) {
+                // The hunk starts at the token after its position, found in
+                // one pass over the tokens between the previous hunk and it
+                size_t skip = std::string_view::npos;
+                if (edit.old_token >= cursor_token) {
+                    skip = tokenizer->SkipTokens(old_text.substr(cursor), edit.old_token - cursor_token);
+                }
+                if (skip == std::string_view::npos) {
+                    throw std::runtime_error("Hunk does not match the old text");
+                }
+                offset = cursor + skip;
+                if (old_text.compare(offset, length, edit.old_text) != 0 ||
+                    tokenizer->CountTokens(edit.old_text) != edit.old_tokens) {
+                    throw std::runtime_error("Hunk does not match the old text");
+                }
+            }
+            else if (edit.old_text.empty()) {
+                // Without a tokenizer only the top of the text is known
+                if (!edit.at_start || cursor != 0) {
+                    throw std::runtime_error("Hunk without old text can not be located");
+                }
+                offset = 0;
+            }
+            else {
+                offset = old_text.find(edit.old_text, cursor);
+                if (offset == std::string_view::npos) {
+                    throw std::runtime_error("Hunk does not match the old text");
+                }
+            }
+            cursor_token = edit.old_token + edit.old_tokens;
+        }
+
+        if (offset < cursor || length > old_text.size() - offset) {
+            throw std::runtime_error("Patch does not fit the old text");
+        }
+
+        sink.Copy(cursor, offset - cursor);
+        sink.Write(edit.new_text);
+        cursor = offset + length;
+    }
+
+    sink.Copy(cursor, old_text.size() - cursor);
+}
+
+std::string Patch::Apply(std::string_view old_text, const Tokenizer* tokenizer) const {
+    std::string result;
+    result.reserve(old_text.size());
+
+    StringSink sink(old_text, result);
+    Run(old_text, sink, tokenizer);
+
+    return result;
+}
+
+void Patch::ApplyFile(const std::string& old_path, const std::string& new_path, const Tokenizer* tokenizer) const {
+    MappedFile old_file(old_path);
+
+#ifndef _WIN32
+    int out_fd = ::open(new_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        throw std::runtime_error("Can't create file " + new_path);
+    }
+    // Without a descriptor of its own the old file is copied from the mapping
+    int in_fd = ::open(old_path.c_str(), O_RDONLY);
+
+    try {
+        FileSink sink(in_fd, out_fd, old_file.Data());
+        Run(old_file.Data(), sink, tokenizer);
+        sink.Flush();
+    }
+    catch (...) {
+        if (in_fd >= 0) {
+            ::close(in_fd);
+        }
+        ::close(out_fd);
+        throw;
+    }
+
+    if (in_fd >= 0) {
+        ::close(in_fd);
+    }
+    if (::close(out_fd) != 0) {
+        throw std::runtime_error("Can't write file " + new_path);
+    }
+#else
+    std::string result = Apply(old_file.Data(), tokenizer);
+    std::ofstream out(new_path, std::ios::binary);
+    out.write(result.data(), result.size());
+    if (!out) {
+        throw std::runtime_error("Can't write file " + new_path);
+    }
+#endif
+}
+
+size_t Patch::EditCount() const {
+    return edits_.size();
+}
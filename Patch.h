@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Tokenizer.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Rebuilds the new text from the old one and a diff produced by Diff: the
+// unified output of GetDiff or a binary edit script with text. Bytes between
+// the edits are copied from the old text in whole blocks, never tokenized.
+//
+// Unified hunks carry token positions only. Given the tokenizer the diff was
+// made with, a hunk is placed exactly by walking the tokens once from the
+// previous hunk to its position, and its old side is checked there. Without
+// it, the old side is searched for after the previous hunk, which is exact
+// when the text repeats rarely; a hunk with no old side, as insertions are
+// without context, then can only be placed at the top of the text. Binary scripts carry byte lengths and
+// are always applied exactly.
+class Patch {
+public:
+    // Throws std::runtime_error on malformed input
+    static Patch Parse(std::string_view diff);
+
+    // Both throw std::runtime_error if the patch does not fit the old text
+    std::string Apply(std::string_view old_text, const Tokenizer* tokenizer = nullptr) const;
+    // The old file is mapped, unchanged regions are copied file to file
+    // where the platform allows
+    void ApplyFile(const std::string& old_path, const std::string& new_path, const Tokenizer* tokenizer = nullptr) const;
+
+    size_t EditCount() const;
+
+private:
+    // Old bytes replaced by new ones, unified hunks get their offset when applied
+    struct Edit {
+        bool located = false;
+        size_t old_offset = 0;
+        size_t old_length = 0;
+        std::string old_text;
+        std::string new_text;
+        size_t old_token = 0;  // unified hunk position and size in old tokens
+        size_t old_tokens = 0;
+        bool at_start = false; // unified hunk with no old side, at the top of the text
+    };
+
+    static void ParseUnified(std::string_view diff, Patch& patch);
+    static void ParseScript(std::string_view script, Patch& patch);
+
+    template <typename Sink>
+    void Run(std::string_view old_text, Sink& sink, const Tokenizer* tokenizer) const;
+
+    std::vector<Edit> edits_;
+    bool has_size_ = false;
+    size_t old_size_ = 0; // old text size a binary script was made for
+};
@@ -0,0 +1,456 @@
+#include "Simd.h"
+#include <cstdint>
+#include <cstring>
+
+// Vector paths need GCC or Clang for per-function targets and bit builtins,
+// other compilers get the scalar loops
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_X86 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+namespace {
+
+size_t CommonPrefixScalar(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+size_t CommonSuffixScalar(const char* a_end, const char* b_end, size_t n) {
+    size_t i = 0;
+    while (i < n && a_end[-1 - static_cast<ptrdiff_t>(i)] == b_end[-1 - static_cast<ptrdiff_t>(i)]) {
+        i++;
+    }
+    return i;
+}
+
+// Bytes of the valid UTF-8 sequence at the start of s, 0 if it is malformed
+// or cut off: overlong forms, surrogates and code points past U+10FFFF
+// are rejected by the range of the second byte
+size_t Utf8SequenceScalar(const unsigned char* s, size_t n) {
+    unsigned char c = s[0];
+    if (c < 0x80) {
+        return 1;
+    }
+
+    size_t len = 0;
+    unsigned char low = 0x80, high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+    }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        low = (c == 0xE0) ? 0xA0 : low;
+        high = (c == 0xED) ? 0x9F : high;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        low = (c == 0xF0) ? 0x90 : low;
+        high = (c == 0xF4) ? 0x8F : high;
+    }
+    if (len == 0 || len > n || s[1] < low || s[1] > high) {
+        return 0;
+    }
+    for (size_t k = 2; k < len; k++) {
+        if ((s[k] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+size_t Utf8ValidateScalar(const char* data, size_t n) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < n) {
+        size_t len = Utf8SequenceScalar(s + i, n - i);
+        if (len == 0) {
+            return i;
+        }
+        i += len;
+    }
+    return n;
+}
+
+// Continuation bytes are 0x80-0xBF, every other byte starts a code point
+size_t Utf8LengthScalar(const char* data, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += (static_cast<unsigned char>(data[i]) & 0xC0) != 0x80;
+    }
+    return count;
+}
+
+#ifndef SIMD_X86
+// x86 always has SSE2, only other platforms use it
+uint64_t ByteMaskScalar(const char* data, size_t n, const ByteSet& set) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < set.count; k++) {
+            if (data[i] == set.bytes[k]) {
+                mask |= uint64_t(1) << i;
+                break;
+            }
+        }
+    }
+    return mask;
+}
+#endif
+
+size_t AsciiPrefixScalar(const char* data, size_t n) {
+    size_t i = 0;
+    while (i < n && static_cast<unsigned char>(data[i]) < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef SIMD_X86
+// SSE2 is part of every x86-64 CPU
+size_t CommonPrefixSse2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + CommonPrefixScalar(a + i, b + i, n - i);
+}
+
+size_t CommonSuffixSse2(const char* a_end, const char* b_end, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a_end - i - 16));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b_end - i - 16));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + __builtin_clz(mask) - 16;
+        }
+    }
+    return i + CommonSuffixScalar(a_end - i, b_end - i, n - i);
+}
+
+size_t AsciiPrefixSse2(const char* data, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + AsciiPrefixScalar(data + i, n - i);
+}
+
+// SSE2 has no byte shuffle for the table lookups of the AVX2 path: ASCII
+// runs are skipped a vector at a time, other characters checked one by one
+size_t Utf8ValidateSse2(const char* data, size_t n) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < n) {
+        i += AsciiPrefixSse2(data + i, n - i);
+        if (i == n) {
+            break;
+        }
+        size_t len = Utf8SequenceScalar(s + i, n - i);
+        if (len == 0) {
+            return i;
+        }
+        i += len;
+    }
+    return n;
+}
+
+size_t Utf8LengthSse2(const char* data, size_t n) {
+    // Signed, continuation bytes are the ones below -64
+    const __m128i last_continuation = _mm_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, last_continuation)));
+    }
+    return count + Utf8LengthScalar(data + i, n - i);
+}
+
+// Blocks shorter than 64 bytes are copied into a zeroed one, the bits past
+// their end are cleared
+uint64_t ByteMaskSse2(const char* data, size_t n, const ByteSet& set) {
+    alignas(16) char block[64];
+    if (n < 64) {
+        std::memset(block, 0, sizeof(block));
+        std::memcpy(block, data, n);
+        data = block;
+    }
+
+    uint64_t mask = 0;
+    for (size_t part = 0; part < 64; part += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + part));
+        __m128i found = _mm_setzero_si128();
+        for (size_t k = 0; k < set.count; k++) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(v, _mm_set1_epi8(set.bytes[k])));
+        }
+        mask |= uint64_t(static_cast<unsigned>(_mm_movemask_epi8(found))) << part;
+    }
+    return (n < 64) ? mask & ((uint64_t(1) << n) - 1) : mask;
+}
+#endif
+
+#ifdef SIMD_X86
+TARGET_AVX2 size_t CommonPrefixAvx2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + CommonPrefixSse2(a + i, b + i, n - i);
+}
+
+TARGET_AVX2 size_t CommonSuffixAvx2(const char* a_end, const char* b_end, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a_end - i - 32));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b_end - i - 32));
+        unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+        if (mask != 0) {
+            return i + __builtin_clz(mask);
+        }
+    }
+    return i + CommonSuffixSse2(a_end - i, b_end - i, n - i);
+}
+
+// Lookup validation of Keiser and Lemire: three 16-entry tables indexed by
+// the nibbles of each byte and the one before it flag every error class,
+// a byte is bad where all three agree. Continuations expected after three
+// and four byte leads are the only legal pairs of continuation bytes
+constexpr uint8_t kTooShort = 1 << 0;    // lead not followed by a continuation
+constexpr uint8_t kTooLong = 1 << 1;     // continuation after ASCII
+constexpr uint8_t kOverlong3 = 1 << 2;
+constexpr uint8_t kTooLarge = 1 << 3;
+constexpr uint8_t kSurrogate = 1 << 4;
+constexpr uint8_t kOverlong2 = 1 << 5;
+constexpr uint8_t kTooLarge1000 = 1 << 6;
+constexpr uint8_t kOverlong4 = 1 << 6;
+constexpr uint8_t kTwoConts = 1 << 7;
+constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+alignas(16) const uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+};
+
+alignas(16) const uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+};
+
+alignas(16) const uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort,
+};
+
+TARGET_AVX2 __m256i Table(const uint8_t* table) {
+    return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+}
+
+TARGET_AVX2 __m256i HighNibbles(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+// Every byte of input moved n places up, the first ones taken from the end of previous
+template <int N>
+TARGET_AVX2 __m256i Previous(__m256i input, __m256i previous) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+// Nonzero bytes where input is not valid UTF-8 following previous
+TARGET_AVX2 __m256i Utf8Errors(__m256i input, __m256i previous) {
+    __m256i prev1 = Previous<1>(input, previous);
+    __m256i byte_1_high = _mm256_shuffle_epi8(Table(kByte1High), HighNibbles(prev1));
+    __m256i byte_1_low = _mm256_shuffle_epi8(Table(kByte1Low), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    __m256i byte_2_high = _mm256_shuffle_epi8(Table(kByte2High), HighNibbles(input));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i third = _mm256_subs_epu8(Previous<2>(input, previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(Previous<3>(input, previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+TARGET_AVX2 size_t Utf8ValidateAvx2(const char* data, size_t n) {
+    __m256i previous = _mm256_setzero_si256();
+    for (size_t i = 0; ; i += 32) {
+        // The last block is padded with zeros, a sequence cut off by the
+        // end of the text fails on them
+        bool last = i + 32 > n;
+        __m256i input;
+        if (!last) {
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        }
+        else {
+            alignas(32) char block[32] = {};
+            std::memcpy(block, data + i, n - i);
+            input = _mm256_load_si256(reinterpret_cast<const __m256i*>(block));
+        }
+
+        __m256i errors = Utf8Errors(input, previous);
+        if (!_mm256_testz_si256(errors, errors)) {
+            // Everything before the block is valid, the bad sequence starts
+            // at most three bytes before it: the scalar check resumes from
+            // the first character boundary there
+            size_t start = (i >= 3) ? i - 3 : 0;
+            while (start < i && (static_cast<unsigned char>(data[start]) & 0xC0) == 0x80) {
+                start++;
+            }
+            return start + Utf8ValidateScalar(data + start, n - start);
+        }
+        if (last) {
+            return n;
+        }
+        previous = input;
+    }
+}
+
+TARGET_AVX2 size_t Utf8LengthAvx2(const char* data, size_t n) {
+    const __m256i last_continuation = _mm256_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, last_continuation)));
+    }
+    return count + Utf8LengthSse2(data + i, n - i);
+}
+
+TARGET_AVX2 size_t AsciiPrefixAvx2(const char* data, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + AsciiPrefixSse2(data + i, n - i);
+}
+
+TARGET_AVX2 uint64_t ByteMaskAvx2(const char* data, size_t n, const ByteSet& set) {
+    alignas(32) char block[64];
+    if (n < 64) {
+        std::memset(block, 0, sizeof(block));
+        std::memcpy(block, data, n);
+        data = block;
+    }
+
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+    __m256i found_low = _mm256_setzero_si256();
+    __m256i found_high = _mm256_setzero_si256();
+    for (size_t k = 0; k < set.count; k++) {
+        __m256i byte = _mm256_set1_epi8(set.bytes[k]);
+        found_low = _mm256_or_si256(found_low, _mm256_cmpeq_epi8(low, byte));
+        found_high = _mm256_or_si256(found_high, _mm256_cmpeq_epi8(high, byte));
+    }
+    uint64_t mask = uint64_t(static_cast<unsigned>(_mm256_movemask_epi8(found_low))) |
+        (uint64_t(static_cast<unsigned>(_mm256_movemask_epi8(found_high))) << 32);
+    return (n < 64) ? mask & ((uint64_t(1) << n) - 1) : mask;
+}
+#endif
+
+struct Dispatch {
+    size_t (*common_prefix)(const char*, const char*, size_t);
+    size_t (*common_suffix)(const char*, const char*, size_t);
+    size_t (*utf8_validate)(const char*, size_t);
+    size_t (*utf8_length)(const char*, size_t);
+    size_t (*ascii_prefix)(const char*, size_t);
+    uint64_t (*byte_mask)(const char*, size_t, const ByteSet&);
+
+    Dispatch() {
+#ifdef SIMD_X86
+        if (__builtin_cpu_supports("avx2")) {
+            common_prefix = CommonPrefixAvx2;
+            common_suffix = CommonSuffixAvx2;
+            utf8_validate = Utf8ValidateAvx2;
+            utf8_length = Utf8LengthAvx2;
+            ascii_prefix = AsciiPrefixAvx2;
+            byte_mask = ByteMaskAvx2;
+            return;
+        }
+        common_prefix = CommonPrefixSse2;
+        common_suffix = CommonSuffixSse2;
+        utf8_validate = Utf8ValidateSse2;
+        utf8_length = Utf8LengthSse2;
+        ascii_prefix = AsciiPrefixSse2;
+        byte_mask = ByteMaskSse2;
+#else
+        common_prefix = CommonPrefixScalar;
+        common_suffix = CommonSuffixScalar;
+        utf8_validate = Utf8ValidateScalar;
+        utf8_length = Utf8LengthScalar;
+        ascii_prefix = AsciiPrefixScalar;
+        byte_mask = ByteMaskScalar;
+#endif
+    }
+};
+
+const Dispatch& GetDispatch() {
+    static const Dispatch dispatch;
+    return dispatch;
+}
+
+}
+
+size_t CommonPrefix(const char* a, const char* b, size_t n) {
+    return GetDispatch().common_prefix(a, b, n);
+}
+
+size_t CommonSuffix(const char* a_end, const char* b_end, size_t n) {
+    return GetDispatch().common_suffix(a_end, b_end, n);
+}
+
+size_t Utf8Validate(const char* data, size_t n) {
+    return GetDispatch().utf8_validate(data, n);
+}
+
+size_t Utf8Length(const char* data, size_t n) {
+    return GetDispatch().utf8_length(data, n);
+}
+
+size_t AsciiPrefix(const char* data, size_t n) {
+    return GetDispatch().ascii_prefix(data, n);
+}
+
+uint64_t ByteMask(const char* data, size_t n, const ByteSet& set) {
+    return GetDispatch().byte_mask(data, n, set);
+}
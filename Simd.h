@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Byte scanning helpers with AVX2 and SSE2 paths, the widest one
+// supported by the running CPU is picked on first use
+
+// Length of the common prefix of the first n bytes of a and b
+size_t CommonPrefix(const char* a, const char* b, size_t n);
+
+// Length of the common suffix of the n bytes before a_end and b_end
+size_t CommonSuffix(const char* a_end, const char* b_end, size_t n);
+
+// Offset of the first byte of the first malformed UTF-8 sequence in the n
+// bytes at data, n if they are all valid
+size_t Utf8Validate(const char* data, size_t n);
+
+// Number of code points in n bytes of valid UTF-8
+size_t Utf8Length(const char* data, size_t n);
+
+// Length of the run of ASCII bytes at the start of the n bytes at data
+size_t AsciiPrefix(const char* data, size_t n);
+
+// Up to eight bytes text is split at
+struct ByteSet {
+    const char* bytes;
+    size_t count;
+};
+
+// Bit i is set where byte i of the n <= 64 bytes at data is in set
+uint64_t ByteMask(const char* data, size_t n, const ByteSet& set);
+
+inline unsigned LowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    unsigned bit = 0;
+    for (; (mask & 1) == 0; mask >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+inline unsigned BitCount(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(mask);
+#else
+    unsigned count = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Hands out the positions of delimiter bytes in text in order, they are
+// found 64 at a time
+class DelimiterScanner {
+public:
+    DelimiterScanner(std::string_view text, const ByteSet& delimiters)
+        : text_(text), delimiters_(delimiters) {
+    }
+
+    // Position of the next delimiter, the text size after the last one
+    size_t Next() {
+        while (mask_ == 0) {
+            if (next_block_ >= text_.size()) {
+                return text_.size();
+            }
+            block_ = next_block_;
+            mask_ = ByteMask(text_.data() + block_, std::min<size_t>(64, text_.size() - block_), delimiters_);
+            next_block_ += 64;
+        }
+        size_t pos = block_ + LowestBit(mask_);
+        mask_ &= mask_ - 1;
+        return pos;
+    }
+
+private:
+    std::string_view text_;
+    ByteSet delimiters_;
+    size_t block_ = 0;
+    size_t next_block_ = 0;
+    uint64_t mask_ = 0;
+};
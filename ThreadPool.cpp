@@ -0,0 +1,111 @@
+#include "ThreadPool.h"
+
+namespace {
+
+thread_local int current_worker = -1;
+
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers_.emplace_back(&ThreadPool::Run, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    size_t index = (current_worker >= 0) ? current_worker : 0;
+    // Counted before it can be taken: a worker that steals the task at once
+    // must not bring pending_ to 0 while its parent is still running
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_++;
+        pending_++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+}
+
+size_t ThreadPool::Size() const {
+    return workers_.size();
+}
+
+int ThreadPool::CurrentWorker() {
+    return current_worker;
+}
+
+void ThreadPool::Run(size_t index) {
+    current_worker = static_cast<int>(index);
+
+    std::function<void()> task;
+    while (true) {
+        if (TryPop(index, task)) {
+            task();
+            task = nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) {
+                done_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::TryPop(size_t index, std::function<void()>& task) {
+    // Own deque from the back, keeps recently split ranges in cache
+    for (size_t n = 0; n < queues_.size(); n++) {
+        Queue& queue = *queues_[(index + n) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        if (n == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+
+        std::lock_guard<std::mutex> counter_lock(mutex_);
+        queued_--;
+        return true;
+    }
+
+    return false;
+}
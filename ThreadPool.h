@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque each. Workers take their
+// own newest tasks first and steal the oldest ones of other workers when idle
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Called from a worker, the task goes to that worker's own deque
+    void Submit(std::function<void()> task);
+    // Blocks until every submitted task, including ones submitted by tasks, is done
+    void Wait();
+
+    size_t Size() const;
+    // Index of the calling worker thread, -1 for other threads
+    static int CurrentWorker();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void Run(size_t index);
+    bool TryPop(size_t index, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t queued_ = 0;  // tasks waiting in the deques
+    size_t pending_ = 0; // tasks submitted and not finished yet
+    bool stop_ = false;
+};
@@ -1,4 +1,5 @@
 #include "Tokenizer.h"
+#include "Simd.h"
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -31,96 +32,299 @@ std::string_view TokenInfo::GetText() const {
     return text_;
 }
 
+Utf8Error::Utf8Error(size_t offset, const std::string& source)
+    : std::runtime_error((source.empty() ? "" : source + ": ") + "invalid UTF-8 at byte " + std::to_string(offset)),
+      offset_(offset) {
+}
+
+size_t Utf8Error::Offset() const {
+    return offset_;
+}
+
 Tokenizer::Tokenizer(ParserMode parser_mode)
     : parser_mode_(parser_mode) {
 }
 
-std::vector<std::string> Tokenizer::SplitIntoUtf8Chars(const std::string& text) const {
-    std::vector<std::string> chars;
+// Bytes of the character starting at i, malformed or cut off sequences count as one byte
+size_t Tokenizer::CharLength(std::string_view text, size_t i) const {
+    size_t char_len = 1;
 
-    for (size_t i = 0; i < text.length(); ) {
-        int char_len = 1;
+    if (parser_mode_ == ParserMode::UTF_8) {
+        if ((text[i] & 0xE0) == 0xC0) char_len = 2;
+        else if ((text[i] & 0xF0) == 0xE0) char_len = 3;
+        else if ((text[i] & 0xF8) == 0xF0) char_len = 4;
+    }
 
-        if (parser_mode_ == ParserMode::UTF_8) {
-            if ((text[i] & 0xE0) == 0xC0) char_len = 2;
-            else if ((text[i] & 0xF0) == 0xE0) char_len = 3;
-            else if ((text[i] & 0xF8) == 0xF0) char_len = 4;
-        }
+    return (i + char_len <= text.length()) ? char_len : 1;
+}
 
-        if (i + char_len <= text.length()) {
-            chars.push_back(text.substr(i, char_len));
-        }
-        else {
-            chars.push_back(text.substr(i, 1));
+void Tokenizer::CheckUtf8(std::string_view text) const {
+    if (parser_mode_ != ParserMode::UTF_8) {
+        return;
+    }
+    size_t offset = Utf8Validate(text.data(), text.size());
+    if (offset != text.size()) {
+        throw Utf8Error(offset);
+    }
+}
+
+template <typename Fn>
+void Tokenizer::ForEachChar(std::string_view text, Fn&& fn) const {
+    for (size_t i = 0; i < text.length(); ) {
+        // ASCII runs are found a vector at a time, every byte is a character
+        if (parser_mode_ == ParserMode::UTF_8) {
+            size_t end = i + AsciiPrefix(text.data() + i, text.length() - i);
+            for (; i < end; i++) {
+                fn(text.substr(i, 1));
+            }
+            if (i == text.length()) {
+                break;
+            }
         }
 
+        size_t char_len = CharLength(text, i);
+        fn(text.substr(i, char_len));
         i += char_len;
     }
+}
+
+namespace {
+
+// Delimiters are ASCII and never part of a multi-byte character, so text
+// is cut on bytes
+const ByteSet kWordDelimiters = { " \t\n\r", 4 };
+// The bytes std::isspace accepts in the C locale
+const ByteSet kWhitespace = { " \t\n\v\f\r", 6 };
 
-    return chars;
 }
 
-std::vector<std::string> Tokenizer::SplitIntoWords(const std::string& text) const {
-    std::vector<std::string> words;
-    std::string current_word;
+// Pieces of text between delimiters, every delimiter is a piece of its own
+// if kept; empty pieces are skipped
+template <typename Fn>
+void Tokenizer::ForEachSplit(std::string_view text, const ByteSet& delimiters, bool keep_delimiters, Fn&& fn) const {
+    DelimiterScanner scanner(text, delimiters);
+    size_t start = 0;
+    for (size_t i = scanner.Next(); i < text.length(); i = scanner.Next()) {
+        if (i > start) {
+            fn(text.substr(start, i - start));
+        }
+        if (keep_delimiters) {
+            fn(text.substr(i, 1));
+        }
+        start = i + 1;
+    }
 
-    auto chars = SplitIntoUtf8Chars(text);
+    if (start < text.length()) {
+        fn(text.substr(start));
+    }
+}
+
+// Same count as ForEachSplit from the delimiter masks alone: a piece
+// starts at every byte that is no delimiter and follows one
+size_t Tokenizer::CountSplits(std::string_view text, const ByteSet& delimiters, bool keep_delimiters) const {
+    size_t count = 0;
+    uint64_t carry = 1;
+    for (size_t block = 0; block < text.length(); block += 64) {
+        size_t n = std::min<size_t>(64, text.length() - block);
+        uint64_t delims = ByteMask(text.data() + block, n, delimiters);
+        uint64_t bytes = (n == 64) ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+        uint64_t starts = ~delims & bytes & ((delims << 1) | carry);
+        count += BitCount(starts) + (keep_delimiters ? BitCount(delims) : 0);
+        carry = delims >> 63;
+    }
+    return count;
+}
 
-    for (const auto& c : chars) {
-        if (c == " " || c == "\t" || c == "\n" || c == "\r") {
-            if (!current_word.empty()) {
-                words.push_back(current_word);
-                current_word.clear();
+// Start of piece count + 1 from the same masks, the block holding it is
+// the only one whose pieces are not merely counted
+size_t Tokenizer::SkipSplits(std::string_view text, const ByteSet& delimiters, bool keep_delimiters, size_t count) const {
+    uint64_t carry = 1;
+    for (size_t block = 0; block < text.length(); block += 64) {
+        size_t n = std::min<size_t>(64, text.length() - block);
+        uint64_t delims = ByteMask(text.data() + block, n, delimiters);
+        uint64_t bytes = (n == 64) ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+        uint64_t starts = ~delims & bytes & ((delims << 1) | carry);
+        if (keep_delimiters) {
+            starts |= delims;
+        }
+        size_t pieces = BitCount(starts);
+        if (count < pieces) {
+            for (; count > 0; count--) {
+                starts &= starts - 1;
             }
-            words.push_back(c);
+            return block + LowestBit(starts);
         }
-        else {
-            current_word += c;
+        count -= pieces;
+        carry = delims >> 63;
+    }
+    return (count == 0) ? text.length() : std::string_view::npos;
+}
+
+template <typename Fn>
+void Tokenizer::ForEachWord(std::string_view text, Fn&& fn) const {
+    ForEachSplit(text, kWordDelimiters, true, std::forward<Fn>(fn));
+}
+
+size_t Tokenizer::CountUtf8Chars(std::string_view text) const {
+    if (parser_mode_ == ParserMode::BYTES) {
+        return text.length();
+    }
+    if (Utf8Validate(text.data(), text.length()) == text.length()) {
+        return Utf8Length(text.data(), text.length());
+    }
+
+    size_t count = 0;
+    ForEachChar(text, [&count](std::string_view) {
+        count++;
+    });
+
+    return count;
+}
+
+size_t Tokenizer::CountWords(std::string_view text) const {
+    return CountSplits(text, kWordDelimiters, true);
+}
+
+size_t Tokenizer::SkipUtf8Chars(std::string_view text, size_t count) const {
+    if (parser_mode_ == ParserMode::BYTES) {
+        return (count <= text.length()) ? count : std::string_view::npos;
+    }
+
+    size_t i = 0;
+    while (count > 0 && i < text.length()) {
+        // ASCII runs are skipped a vector at a time, never past count
+        size_t ascii = AsciiPrefix(text.data() + i, std::min(count, text.length() - i));
+        i += ascii;
+        count -= ascii;
+        if (count > 0 && i < text.length()) {
+            i += CharLength(text, i);
+            count--;
         }
     }
 
-    if (!current_word.empty()) {
-        words.push_back(current_word);
+    return (count == 0) ? i : std::string_view::npos;
+}
+
+void Tokenizer::DecodeInto(const TokenId* tokens, size_t count, std::string& out) const {
+    for (size_t i = 0; i < count; ++i) {
+        out += TokenText(tokens[i]);
     }
+}
 
-    return words;
+std::string_view Tokenizer::TokenText(TokenId token) const {
+    return vocab_.Text(token);
 }
 
-bool Tokenizer::IsUtf8Char(char c) const {
-    return parser_mode_ == ParserMode::UTF_8 && (c & 0x80);
+const Vocabulary& Tokenizer::GetVocabulary() const {
+    return vocab_;
 }
 
-BPETokenizer::BPETokenizer(ParserMode parser_mode)
-    : Tokenizer(parser_mode) {
-    vocab_["<unk>"] = 0;
-    vocab_["<s>"] = 1;
-    vocab_["</s>"] = 2;
-    vocab_["<pad>"] = 3;
+WordCache::WordCache(size_t capacity)
+    : shards_(new Shard[kShards]) {
+    SetCapacity(capacity);
+}
 
-    inverse_vocab_[0] = "<unk>";
-    inverse_vocab_[1] = "<s>";
-    inverse_vocab_[2] = "</s>";
-    inverse_vocab_[3] = "<pad>";
+WordCache::Shard& WordCache::ShardOf(std::string_view word) {
+    uint64_t hash = std::hash<std::string_view>()(word);
+    return shards_[(hash * 0x9E3779B97F4A7C15ull) >> 60];
 }
 
-std::vector<TokenId> BPETokenizer::Encode(const std::string& text) const {
-    std::vector<TokenId> result;
+bool WordCache::Find(std::string_view word, std::vector<TokenId>& ids) {
+    if (shard_capacity_ == 0 || word.size() > kMaxWordLength) {
+        return false;
+    }
+
+    Shard& shard = ShardOf(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(word);
+    if (found == shard.index.end()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Entry& entry = shard.entries[found->second];
+    entry.referenced = true;
+    ids.insert(ids.end(), entry.ids.begin(), entry.ids.end());
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
 
-    auto words = SplitIntoWords(text);
+void WordCache::Add(std::string_view word, const TokenId* ids, size_t count) {
+    if (shard_capacity_ == 0 || word.size() > kMaxWordLength) {
+        return;
+    }
 
-    for (const auto& word : words) {
-        auto word_tokens = ApplyBPE(word);
+    Shard& shard = ShardOf(word);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Another thread may have added it meanwhile
+    if (shard.index.count(word) != 0) {
+        return;
+    }
 
-        for (const auto& token : word_tokens) {
-            auto it = vocab_.find(token);
-            if (it != vocab_.end()) {
-                result.push_back(it->second);
-            }
-            else {
-                result.push_back(vocab_.at("<unk>"));
-            }
+    size_t slot;
+    if (shard.entries.size() < shard_capacity_) {
+        if (shard.entries.empty()) {
+            shard.entries.reserve(shard_capacity_);
         }
+        slot = shard.entries.size();
+        shard.entries.emplace_back();
     }
+    else {
+        // Entries found since the last sweep get one more round
+        while (shard.entries[shard.hand].referenced) {
+            shard.entries[shard.hand].referenced = false;
+            shard.hand = (shard.hand + 1) % shard_capacity_;
+        }
+        slot = shard.hand;
+        shard.hand = (shard.hand + 1) % shard_capacity_;
+        shard.index.erase(shard.entries[slot].word);
+    }
+
+    Entry& entry = shard.entries[slot];
+    entry.word.assign(word);
+    entry.ids.assign(ids, ids + count);
+    entry.referenced = false;
+    shard.index.emplace(entry.word, slot);
+}
+
+void WordCache::Clear() {
+    for (size_t i = 0; i < kShards; i++) {
+        shards_[i].index.clear();
+        shards_[i].entries.clear();
+        shards_[i].entries.shrink_to_fit();
+        shards_[i].hand = 0;
+    }
+}
+
+void WordCache::SetCapacity(size_t capacity) {
+    Clear();
+    shard_capacity_ = (capacity + kShards - 1) / kShards;
+}
+
+WordCacheStats WordCache::GetStats() const {
+    WordCacheStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+BPETokenizer::BPETokenizer(ParserMode parser_mode)
+    : Tokenizer(parser_mode) {
+    vocab_.Assign("<unk>", 0);
+    vocab_.Assign("<s>", 1);
+    vocab_.Assign("</s>", 2);
+    vocab_.Assign("<pad>", 3);
+}
+
+std::vector<TokenId> BPETokenizer::Encode(std::string_view text) const {
+    CheckUtf8(text);
+
+    std::vector<TokenId> result;
+
+    TokenId unknown = vocab_.Find("<unk>");
+    ForEachWord(text, [this, &result, unknown](std::string_view word) {
+        EncodeWord(word, unknown, result);
+    });
 
     return result;
 }
@@ -129,20 +333,43 @@ std::string BPETokenizer::Decode(const std::vector<TokenId>& tokens) const {
     std::string result;
 
     for (auto token_id : tokens) {
-        auto it = inverse_vocab_.find(token_id);
-        if (it != inverse_vocab_.end()) {
-            result += it->second;
-        }
-        else {
-            result += inverse_vocab_.at(0);
-        }
+        result += vocab_.Text(token_id);
     }
 
     return result;
 }
 
-const std::unordered_map<std::string, TokenId>& BPETokenizer::GetVocabulary() const {
-    return vocab_;
+size_t BPETokenizer::CountTokens(std::string_view text) const {
+    size_t count = 0;
+    TokenId unknown = vocab_.Find("<unk>");
+    std::vector<TokenId> ids;
+    ForEachWord(text, [this, &count, unknown, &ids](std::string_view word) {
+        ids.clear();
+        EncodeWord(word, unknown, ids);
+        count += ids.size();
+    });
+
+    return count;
+}
+
+size_t BPETokenizer::SkipTokens(std::string_view text, size_t count) const {
+    TokenId unknown = vocab_.Find("<unk>");
+    std::vector<TokenId> ids;
+    size_t i = 0;
+    while (count > 0 && i < text.length()) {
+        // Whole words are counted through the cache, only the word holding
+        // the token after count is split again
+        std::string_view word = text.substr(i, SkipSplits(text.substr(i), kWordDelimiters, true, 1));
+        ids.clear();
+        EncodeWord(word, unknown, ids);
+        if (count < ids.size()) {
+            return i + (ApplyBPE(word)[count].data() - word.data());
+        }
+        count -= ids.size();
+        i += word.length();
+    }
+
+    return (count == 0) ? i : std::string_view::npos;
 }
 
 bool BPETokenizer::SaveVocabulary(const std::string& file_path) const {
@@ -151,9 +378,9 @@ bool BPETokenizer::SaveVocabulary(const std::string& file_path) const {
         return false;
     }
 
-    for (const auto& [token, id] : vocab_) {
+    vocab_.ForEach([&file](std::string_view token, TokenId id) {
         file << token << "\t" << id << "\n";
-    }
+    });
 
     file << "# Merges\n";
     for (const auto& [first, second] : merges_) {
@@ -169,8 +396,7 @@ bool BPETokenizer::LoadVocabulary(const std::string& file_path) {
         return false;
     }
 
-    vocab_.clear();
-    inverse_vocab_.clear();
+    vocab_.Clear();
     merges_.clear();
 
     std::string line;
@@ -196,30 +422,29 @@ bool BPETokenizer::LoadVocabulary(const std::string& file_path) {
             std::string token;
             TokenId id;
             if (std::getline(iss, token, '\t') && iss >> id) {
-                vocab_[token] = id;
-                inverse_vocab_[id] = token;
+                vocab_.Assign(token, id);
             }
         }
     }
+    IndexMerges();
+    cache_.Clear();
 
     return true;
 }
 
 void BPETokenizer::Train(const std::vector<std::string>& corpus, int vocab_size, int min_frequency) {
+    // A malformed text leaves the old vocabulary in place
+    for (const auto& text : corpus) {
+        CheckUtf8(text);
+    }
 
-    vocab_.clear();
-    inverse_vocab_.clear();
+    vocab_.Clear();
     merges_.clear();
 
-    vocab_["<unk>"] = 0;
-    vocab_["<s>"] = 1;
-    vocab_["</s>"] = 2;
-    vocab_["<pad>"] = 3;
-
-    inverse_vocab_[0] = "<unk>";
-    inverse_vocab_[1] = "<s>";
-    inverse_vocab_[2] = "</s>";
-    inverse_vocab_[3] = "<pad>";
+    vocab_.Assign("<unk>", 0);
+    vocab_.Assign("<s>", 1);
+    vocab_.Assign("</s>", 2);
+    vocab_.Assign("<pad>", 3);
 
     TokenId next_id = 4;
 
@@ -228,25 +453,21 @@ void BPETokenizer::Train(const std::vector<std::string>& corpus, int vocab_size,
 
     for (const auto& text : corpus) {
         std::vector<std::string> chars;
-        for (const auto& word : SplitIntoWords(text)) {
-            auto word_chars = SplitIntoUtf8Chars(word);
-            for (const auto& c : word_chars) {
-                char_counts[c]++;
-                chars.push_back(c);
-            }
-        }
+        ForEachChar(text, [&](std::string_view c) {
+            chars.emplace_back(c);
+            char_counts[chars.back()]++;
+        });
         tokenized_corpus.push_back(chars);
     }
 
     for (const auto& [c, count] : char_counts) {
-        if (count >= min_frequency && vocab_.find(c) == vocab_.end()) {
-            vocab_[c] = next_id;
-            inverse_vocab_[next_id] = c;
+        if (count >= min_frequency && !vocab_.Contains(c)) {
+            vocab_.Assign(c, next_id);
             next_id++;
         }
     }
 
-    while (vocab_.size() < static_cast<size_t>(vocab_size)) {
+    while (vocab_.Size() < static_cast<size_t>(vocab_size)) {
         std::unordered_map<std::string, int> pair_counts;
 
         for (auto& tokens : tokenized_corpus) {
@@ -275,9 +496,8 @@ void BPETokenizer::Train(const std::vector<std::string>& corpus, int vocab_size,
         iss >> first >> second;
 
         std::string new_token = first + second;
-        if (vocab_.find(new_token) == vocab_.end()) {
-            vocab_[new_token] = next_id;
-            inverse_vocab_[next_id] = new_token;
+        if (!vocab_.Contains(new_token)) {
+            vocab_.Assign(new_token, next_id);
             next_id++;
 
             merges_.emplace_back(first, second);
@@ -293,84 +513,192 @@ void BPETokenizer::Train(const std::vector<std::string>& corpus, int vocab_size,
             }
         }
     }
+    IndexMerges();
+    cache_.Clear();
 }
 
 void BPETokenizer::AddMerges(const std::vector<std::pair<std::string, std::string>>& merges) {
     for (const auto& merge : merges) {
-        if (vocab_.find(merge.first) == vocab_.end()) {
-            TokenId new_id = vocab_.size();
-            vocab_[merge.first] = new_id;
-            inverse_vocab_[new_id] = merge.first;
-        }
+        vocab_.Intern(merge.first);
+        vocab_.Intern(merge.second);
+        vocab_.Intern(merge.first + merge.second);
 
-        if (vocab_.find(merge.second) == vocab_.end()) {
-            TokenId new_id = vocab_.size();
-            vocab_[merge.second] = new_id;
-            inverse_vocab_[new_id] = merge.second;
-        }
+        merges_.push_back(merge);
+        IndexMerge(static_cast<uint32_t>(merges_.size() - 1));
+    }
+    cache_.Clear();
+}
 
-        std::string new_token = merge.first + merge.second;
-        if (vocab_.find(new_token) == vocab_.end()) {
-            TokenId new_id = vocab_.size();
-            vocab_[new_token] = new_id;
-            inverse_vocab_[new_id] = new_token;
-        }
+void BPETokenizer::SetCacheCapacity(size_t words) {
+    cache_.SetCapacity(words);
+}
 
-        merges_.push_back(merge);
+WordCacheStats BPETokenizer::GetCacheStats() const {
+    return cache_.GetStats();
+}
+
+void BPETokenizer::IndexMerges() {
+    symbols_.Clear();
+    merge_rules_.clear();
+    later_rank_.clear();
+
+    for (size_t rank = 0; rank < merges_.size(); rank++) {
+        IndexMerge(static_cast<uint32_t>(rank));
     }
 }
 
+void BPETokenizer::IndexMerge(uint32_t rank) {
+    const auto& [first, second] = merges_[rank];
+    TokenId first_id = symbols_.Intern(first);
+    TokenId second_id = symbols_.Intern(second);
+    TokenId merged = symbols_.Intern(first + second);
+
+    later_rank_.push_back(kNoRank);
+    uint64_t key = (static_cast<uint64_t>(first_id) << 32) | second_id;
+    auto [rule, added] = merge_rules_.try_emplace(key, MergeRule{ merged, rank });
+    if (!added) {
+        uint32_t last = rule->second.rank;
+        while (later_rank_[last] != kNoRank) {
+            last = later_rank_[last];
+        }
+        later_rank_[last] = rank;
+    }
+}
+
+uint32_t BPETokenizer::FindMerge(TokenId first, TokenId second, uint32_t min_rank, TokenId& merged) const {
+    auto rule = merge_rules_.find((static_cast<uint64_t>(first) << 32) | second);
+    if (rule == merge_rules_.end()) {
+        return kNoRank;
+    }
+    merged = rule->second.merged;
+
+    uint32_t rank = rule->second.rank;
+    while (rank != kNoRank && rank < min_rank) {
+        rank = later_rank_[rank];
+    }
+    return rank;
+}
 
-std::vector<std::string> BPETokenizer::ApplyBPE(const std::string& word) const {
+// Same result as applying the merges one after another, each to every
+// pair of the word from left to right: the pair of lowest rank is merged
+// first and pairs of equal rank from the left. A merge never applies to a
+// pair that appears only after its rank has been passed, so new pairs are
+// looked up from the next rank on
+std::vector<std::string_view> BPETokenizer::ApplyBPE(std::string_view word) const {
     if (word.empty()) {
         return {};
     }
 
-    std::vector<std::string> tokens = SplitIntoUtf8Chars(word);
+    // A doubly linked list over the word, merged symbols grow to the right
+    // and their right neighbours drop out of the list
+    constexpr size_t kEnd = std::numeric_limits<size_t>::max();
+    struct Symbol {
+        size_t start;
+        size_t length;
+        TokenId id;
+        size_t prev;
+        size_t next;
+    };
+    std::vector<Symbol> symbols;
+    ForEachChar(word, [this, word, &symbols](std::string_view c) {
+        size_t index = symbols.size();
+        symbols.push_back({ static_cast<size_t>(c.data() - word.data()), c.size(), symbols_.Find(c), index - 1, index + 1 });
+    });
+    symbols.front().prev = kEnd;
+    symbols.back().next = kEnd;
+
+    struct Candidate {
+        uint32_t rank;
+        size_t left;
+        TokenId first;
+        TokenId second;
+        TokenId merged;
+
+        bool operator>(const Candidate& rhs) const {
+            return rank != rhs.rank ? rank > rhs.rank : left > rhs.left;
+        }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
 
-    for (const auto& [first, second] : merges_) {
-        for (size_t i = 0; i < tokens.size() - 1; ++i) {
-            if (tokens[i] == first && tokens[i + 1] == second) {
-                tokens[i] = first + second;
-                tokens.erase(tokens.begin() + i + 1);
-                --i;
-            }
+    auto push = [this, &symbols, &queue](size_t left, uint32_t min_rank) {
+        size_t right = symbols[left].next;
+        if (right == kEnd) {
+            return;
+        }
+        Candidate candidate{ 0, left, symbols[left].id, symbols[right].id, 0 };
+        candidate.rank = FindMerge(candidate.first, candidate.second, min_rank, candidate.merged);
+        if (candidate.rank != kNoRank) {
+            queue.push(candidate);
+        }
+    };
+
+    for (size_t i = 0; i + 1 < symbols.size(); i++) {
+        push(i, 0);
+    }
+
+    while (!queue.empty()) {
+        Candidate top = queue.top();
+        queue.pop();
+
+        // Symbols only grow, a side that was merged since has another id
+        Symbol& left = symbols[top.left];
+        if (left.length == 0 || left.id != top.first || left.next == kEnd || symbols[left.next].id != top.second) {
+            continue;
+        }
+
+        Symbol& right = symbols[left.next];
+        left.id = top.merged;
+        left.length += right.length;
+        left.next = right.next;
+        right.length = 0;
+        if (left.next != kEnd) {
+            symbols[left.next].prev = top.left;
         }
+
+        if (left.prev != kEnd) {
+            push(left.prev, top.rank + 1);
+        }
+        push(top.left, top.rank + 1);
     }
 
+    std::vector<std::string_view> tokens;
+    for (size_t i = 0; i != kEnd; i = symbols[i].next) {
+        tokens.push_back(word.substr(symbols[i].start, symbols[i].length));
+    }
     return tokens;
 }
 
+void BPETokenizer::EncodeWord(std::string_view word, TokenId unknown, std::vector<TokenId>& ids) const {
+    if (cache_.Find(word, ids)) {
+        return;
+    }
+
+    size_t first = ids.size();
+    for (std::string_view token : ApplyBPE(word)) {
+        TokenId id = vocab_.Find(token);
+        ids.push_back((id != Vocabulary::kNone) ? id : unknown);
+    }
+    cache_.Add(word, ids.data() + first, ids.size() - first);
+}
+
 CharacterTokenizer::CharacterTokenizer(ParserMode parser_mode)
     : Tokenizer(parser_mode) {
 
-    vocab_["<unk>"] = 0;
-    vocab_[" "] = 1;
-    vocab_["\t"] = 2;
-    vocab_["\n"] = 3;
-
-    inverse_vocab_[0] = "<unk>";
-    inverse_vocab_[1] = " ";
-    inverse_vocab_[2] = "\t";
-    inverse_vocab_[3] = "\n";
+    vocab_.Assign("<unk>", 0);
+    vocab_.Assign(" ", 1);
+    vocab_.Assign("\t", 2);
+    vocab_.Assign("\n", 3);
 }
 
-std::vector<TokenId> CharacterTokenizer::Encode(const std::string& text) const {
+std::vector<TokenId> CharacterTokenizer::Encode(std::string_view text) const {
+    CheckUtf8(text);
+
     std::vector<TokenId> result;
-    auto chars = SplitIntoUtf8Chars(text);
+    result.reserve(text.length());
 
-    for (const auto& c : chars) {
-        auto it = vocab_.find(c);
-        if (it != vocab_.end()) {
-            result.push_back(it->second);
-        }
-        else {
-            TokenId new_id = vocab_.size();
-            const_cast<CharacterTokenizer*>(this)->vocab_[c] = new_id;
-            const_cast<CharacterTokenizer*>(this)->inverse_vocab_[new_id] = c;
-            result.push_back(new_id);
-        }
-    }
+    ForEachChar(text, [this, &result](std::string_view c) {
+        result.push_back(vocab_.Intern(c));
+    });
 
     return result;
 }
@@ -379,20 +707,18 @@ std::string CharacterTokenizer::Decode(const std::vector<TokenId>& tokens) const
     std::string result;
 
     for (auto token_id : tokens) {
-        auto it = inverse_vocab_.find(token_id);
-        if (it != inverse_vocab_.end()) {
-            result += it->second;
-        }
-        else {
-            result += inverse_vocab_.at(0);
-        }
+        result += vocab_.Text(token_id);
     }
 
     return result;
 }
 
-const std::unordered_map<std::string, TokenId>& CharacterTokenizer::GetVocabulary() const {
-    return vocab_;
+size_t CharacterTokenizer::CountTokens(std::string_view text) const {
+    return CountUtf8Chars(text);
+}
+
+size_t CharacterTokenizer::SkipTokens(std::string_view text, size_t count) const {
+    return SkipUtf8Chars(text, count);
 }
 
 bool CharacterTokenizer::SaveVocabulary(const std::string& file_path) const {
@@ -401,9 +727,9 @@ bool CharacterTokenizer::SaveVocabulary(const std::string& file_path) const {
         return false;
     }
 
-    for (const auto& [token, id] : vocab_) {
+    vocab_.ForEach([&file](std::string_view token, TokenId id) {
         file << token << "\t" << id << "\n";
-    }
+    });
 
     return true;
 }
@@ -414,8 +740,7 @@ bool CharacterTokenizer::LoadVocabulary(const std::string& file_path) {
         return false;
     }
 
-    vocab_.clear();
-    inverse_vocab_.clear();
+    vocab_.Clear();
 
     std::string line;
     while (std::getline(file, line)) {
@@ -426,8 +751,7 @@ bool CharacterTokenizer::LoadVocabulary(const std::string& file_path) {
         TokenId id;
 
         if (std::getline(iss, token, '\t') && iss >> id) {
-            vocab_[token] = id;
-            inverse_vocab_[id] = token;
+            vocab_.Assign(token, id);
         }
     }
 
@@ -437,33 +761,20 @@ bool CharacterTokenizer::LoadVocabulary(const std::string& file_path) {
 WordTokenizer::WordTokenizer(ParserMode parser_mode)
     : Tokenizer(parser_mode) {
 
-    vocab_["<unk>"] = 0;
-    vocab_[" "] = 1;
-    vocab_["\t"] = 2;
-    vocab_["\n"] = 3;
-
-    inverse_vocab_[0] = "<unk>";
-    inverse_vocab_[1] = " ";
-    inverse_vocab_[2] = "\t";
-    inverse_vocab_[3] = "\n";
+    vocab_.Assign("<unk>", 0);
+    vocab_.Assign(" ", 1);
+    vocab_.Assign("\t", 2);
+    vocab_.Assign("\n", 3);
 }
 
-std::vector<TokenId> WordTokenizer::Encode(const std::string& text) const {
+std::vector<TokenId> WordTokenizer::Encode(std::string_view text) const {
+    CheckUtf8(text);
+
     std::vector<TokenId> result;
-    auto words = SplitIntoWords(text);
 
-    for (const auto& word : words) {
-        auto it = vocab_.find(word);
-        if (it != vocab_.end()) {
-            result.push_back(it->second);
-        }
-        else {
-            TokenId new_id = vocab_.size();
-            const_cast<WordTokenizer*>(this)->vocab_[word] = new_id;
-            const_cast<WordTokenizer*>(this)->inverse_vocab_[new_id] = word;
-            result.push_back(new_id);
-        }
-    }
+    ForEachWord(text, [this, &result](std::string_view word) {
+        result.push_back(vocab_.Intern(word));
+    });
 
     return result;
 }
@@ -472,20 +783,18 @@ std::string WordTokenizer::Decode(const std::vector<TokenId>& tokens) const {
     std::string result;
 
     for (auto token_id : tokens) {
-        auto it = inverse_vocab_.find(token_id);
-        if (it != inverse_vocab_.end()) {
-            result += it->second;
-        }
-        else {
-            result += inverse_vocab_.at(0);
-        }
+        result += vocab_.Text(token_id);
     }
 
     return result;
 }
 
-const std::unordered_map<std::string, TokenId>& WordTokenizer::GetVocabulary() const {
-    return vocab_;
+size_t WordTokenizer::CountTokens(std::string_view text) const {
+    return CountWords(text);
+}
+
+size_t WordTokenizer::SkipTokens(std::string_view text, size_t count) const {
+    return SkipSplits(text, kWordDelimiters, true, count);
 }
 
 bool WordTokenizer::SaveVocabulary(const std::string& file_path) const {
@@ -494,9 +803,9 @@ bool WordTokenizer::SaveVocabulary(const std::string& file_path) const {
         return false;
     }
 
-    for (const auto& [token, id] : vocab_) {
+    vocab_.ForEach([&file](std::string_view token, TokenId id) {
         file << token << "\t" << id << "\n";
-    }
+    });
 
     return true;
 }
@@ -507,8 +816,7 @@ bool WordTokenizer::LoadVocabulary(const std::string& file_path) {
         return false;
     }
 
-    vocab_.clear();
-    inverse_vocab_.clear();
+    vocab_.Clear();
 
     std::string line;
     while (std::getline(file, line)) {
@@ -519,8 +827,7 @@ bool WordTokenizer::LoadVocabulary(const std::string& file_path) {
         TokenId id;
 
         if (std::getline(iss, token, '\t') && iss >> id) {
-            vocab_[token] = id;
-            inverse_vocab_[id] = token;
+            vocab_.Assign(token, id);
         }
     }
 
@@ -530,28 +837,17 @@ bool WordTokenizer::LoadVocabulary(const std::string& file_path) {
 WhitespaceTokenizer::WhitespaceTokenizer(ParserMode parser_mode)
     : Tokenizer(parser_mode) {
 
-    vocab_["<unk>"] = 0;
-    inverse_vocab_[0] = "<unk>";
+    vocab_.Assign("<unk>", 0);
 }
 
-std::vector<TokenId> WhitespaceTokenizer::Encode(const std::string& text) const {
-    std::vector<TokenId> result;
+std::vector<TokenId> WhitespaceTokenizer::Encode(std::string_view text) const {
+    CheckUtf8(text);
 
-    std::istringstream iss(text);
-    std::string token;
+    std::vector<TokenId> result;
 
-    while (iss >> token) {
-        auto it = vocab_.find(token);
-        if (it != vocab_.end()) {
-            result.push_back(it->second);
-        }
-        else {
-            TokenId new_id = vocab_.size();
-            const_cast<WhitespaceTokenizer*>(this)->vocab_[token] = new_id;
-            const_cast<WhitespaceTokenizer*>(this)->inverse_vocab_[new_id] = token;
-            result.push_back(new_id);
-        }
-    }
+    ForEachSplit(text, kWhitespace, false, [this, &result](std::string_view token) {
+        result.push_back(vocab_.Intern(token));
+    });
 
     return result;
 }
@@ -560,28 +856,30 @@ std::string WhitespaceTokenizer::Decode(const std::vector<TokenId>& tokens) cons
     std::string result;
 
     for (size_t i = 0; i < tokens.size(); ++i) {
-        auto token_id = tokens[i];
-        auto it = inverse_vocab_.find(token_id);
-
-        if (it != inverse_vocab_.end()) {
-            result += it->second;
-            if (i < tokens.size() - 1) {
-                result += " ";
-            }
-        }
-        else {
-            result += inverse_vocab_.at(0);
-            if (i < tokens.size() - 1) {
-                result += " ";
-            }
+        result += vocab_.Text(tokens[i]);
+        if (i < tokens.size() - 1) {
+            result += " ";
         }
     }
 
     return result;
 }
 
-const std::unordered_map<std::string, TokenId>& WhitespaceTokenizer::GetVocabulary() const {
-    return vocab_;
+size_t WhitespaceTokenizer::CountTokens(std::string_view text) const {
+    return CountSplits(text, kWhitespace, false);
+}
+
+size_t WhitespaceTokenizer::SkipTokens(std::string_view text, size_t count) const {
+    return SkipSplits(text, kWhitespace, false, count);
+}
+
+void WhitespaceTokenizer::DecodeInto(const TokenId* tokens, size_t count, std::string& out) const {
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) {
+            out += ' ';
+        }
+        out += TokenText(tokens[i]);
+    }
 }
 
 bool WhitespaceTokenizer::SaveVocabulary(const std::string& file_path) const {
@@ -590,9 +888,9 @@ bool WhitespaceTokenizer::SaveVocabulary(const std::string& file_path) const {
         return false;
     }
 
-    for (const auto& [token, id] : vocab_) {
+    vocab_.ForEach([&file](std::string_view token, TokenId id) {
         file << token << "\t" << id << "\n";
-    }
+    });
 
     return true;
 }
@@ -603,8 +901,7 @@ bool WhitespaceTokenizer::LoadVocabulary(const std::string& file_path) {
         return false;
     }
 
-    vocab_.clear();
-    inverse_vocab_.clear();
+    vocab_.Clear();
 
     std::string line;
     while (std::getline(file, line)) {
@@ -615,9 +912,102 @@ bool WhitespaceTokenizer::LoadVocabulary(const std::string& file_path) {
         TokenId id;
 
         if (std::getline(iss, token, '\t') && iss >> id) {
-            vocab_[token] = id;
-            inverse_vocab_[id] = token;
+            vocab_.Assign(token, id);
+        }
+    }
+
+    return true;
+}
+
+LineTokenizer::LineTokenizer(ParserMode parser_mode)
+    : Tokenizer(parser_mode) {
+
+    vocab_.Assign("<unk>", 0);
+    vocab_.Assign("\n", 1);
+}
+
+std::vector<TokenId> LineTokenizer::Encode(std::string_view text) const {
+    CheckUtf8(text);
+
+    std::vector<TokenId> result;
+
+    // Every token is one line together with its line break
+    for (size_t start = 0; start < text.length(); ) {
+        size_t end = text.find('\n', start);
+        end = (end == std::string::npos) ? text.length() : end + 1;
+
+        result.push_back(vocab_.Intern(text.substr(start, end - start)));
+        start = end;
+    }
+
+    return result;
+}
+
+std::string LineTokenizer::Decode(const std::vector<TokenId>& tokens) const {
+    std::string result;
+
+    for (auto token_id : tokens) {
+        result += vocab_.Text(token_id);
+    }
+
+    return result;
+}
+
+size_t LineTokenizer::CountTokens(std::string_view text) const {
+    size_t count = std::count(text.begin(), text.end(), '\n');
+    if (!text.empty() && text.back() != '\n') {
+        count++;
+    }
+
+    return count;
+}
+
+size_t LineTokenizer::SkipTokens(std::string_view text, size_t count) const {
+    size_t i = 0;
+    for (; count > 0 && i < text.length(); count--) {
+        size_t end = text.find('\n', i);
+        i = (end == std::string_view::npos) ? text.length() : end + 1;
+    }
+
+    return (count == 0) ? i : std::string_view::npos;
+}
+
+bool LineTokenizer::SaveVocabulary(const std::string& file_path) const {
+    std::ofstream file(file_path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    // Lines may contain tabs and the last one may have no line break, so
+    // every token is written whole after its id and length
+    vocab_.ForEach([&file](std::string_view token, TokenId id) {
+        file << id << "\t" << token.size() << "\t";
+        file.write(token.data(), token.size());
+        file << "\n";
+    });
+
+    return true;
+}
+
+bool LineTokenizer::LoadVocabulary(const std::string& file_path) {
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    vocab_.Clear();
+
+    vocab_.Assign("<unk>", 0);
+
+    TokenId id;
+    size_t length;
+    while (file >> id && file.get() == '\t' && file >> length && file.get() == '\t') {
+        std::string token(length, '\0');
+        if (!file.read(&token[0], length)) {
+            break;
         }
+        vocab_.Assign(token, id);
+        file.get();
     }
 
     return true;
@@ -636,6 +1026,8 @@ std::unique_ptr<Tokenizer> CreateTokenizer(
         return std::make_unique<WordTokenizer>(parser_mode);
     case TokenizerMode::WHITESPACE:
         return std::make_unique<WhitespaceTokenizer>(parser_mode);
+    case TokenizerMode::LINE:
+        return std::make_unique<LineTokenizer>(parser_mode);
     default:
         throw std::invalid_argument("Unknown tokenizer mode");
     }
@@ -1,140 +1,266 @@
-#pragma once
-#pragma once
-
-#include <istream>
-#include <memory>
-#include <string>
-#include <unordered_map>
-#include <vector>
-#include <optional>
-#include <unordered_set>
-#include <string_view>
-#include <functional>
-
-using TokenId = uint32_t;
-
-enum class ParserMode { BYTES, UTF_8 };
-
-enum class TokenizerMode {
-    BPE,
-    WORD,
-    CHARACTER,
-    WHITESPACE
-};
-
-class TokenInfo {
-public:
-    TokenInfo(TokenId id, const std::string& text);
-    TokenInfo(TokenId id, std::string_view text);
-
-    bool operator==(const TokenInfo& rhs) const;
-
-    TokenId GetId() const;
-    std::string_view GetText() const;
-
-private:
-    TokenId id_;
-    std::string text_;
-};
-
-class Tokenizer {
-public:
-    Tokenizer(ParserMode parser_mode);
-    virtual ~Tokenizer() = default;
-
-    virtual std::vector<TokenId> Encode(const std::string& text) const = 0;
-    virtual std::string Decode(const std::vector<TokenId>& tokens) const = 0;
-
-    virtual const std::unordered_map<std::string, TokenId>& GetVocabulary() const = 0;
-
-    virtual bool SaveVocabulary(const std::string& file_path) const = 0;
-    virtual bool LoadVocabulary(const std::string& file_path) = 0;
-
-protected:
-    std::vector<std::string> SplitIntoUtf8Chars(const std::string& text) const;
-    std::vector<std::string> SplitIntoWords(const std::string& text) const;
-
-    bool IsUtf8Char(char c) const;
-
-    ParserMode parser_mode_;
-};
-
-class BPETokenizer : public Tokenizer {
-public:
-    BPETokenizer(ParserMode parser_mode);
-
-    std::vector<TokenId> Encode(const std::string& text) const override;
-    std::string Decode(const std::vector<TokenId>& tokens) const override;
-
-    const std::unordered_map<std::string, TokenId>& GetVocabulary() const override;
-
-    bool SaveVocabulary(const std::string& file_path) const override;
-    bool LoadVocabulary(const std::string& file_path) override;
-
-    void Train(const std::vector<std::string>& corpus, int vocab_size, int min_frequency = 2);
-    void AddMerges(const std::vector<std::pair<std::string, std::string>>& merges);
-
-private:
-    std::unordered_map<std::string, TokenId> vocab_;
-    std::unordered_map<TokenId, std::string> inverse_vocab_;
-
-    std::vector<std::pair<std::string, std::string>> merges_;
-
-    std::vector<std::string> ApplyBPE(const std::string& word) const;
-};
-
-class CharacterTokenizer : public Tokenizer {
-public:
-    CharacterTokenizer(ParserMode parser_mode);
-
-    std::vector<TokenId> Encode(const std::string& text) const override;
-    std::string Decode(const std::vector<TokenId>& tokens) const override;
-
-    const std::unordered_map<std::string, TokenId>& GetVocabulary() const override;
-
-    bool SaveVocabulary(const std::string& file_path) const override;
-    bool LoadVocabulary(const std::string& file_path) override;
-
-private:
-    std::unordered_map<std::string, TokenId> vocab_;
-    std::unordered_map<TokenId, std::string> inverse_vocab_;
-};
-
-class WordTokenizer : public Tokenizer {
-public:
-    WordTokenizer(ParserMode parser_mode);
-
-    std::vector<TokenId> Encode(const std::string& text) const override;
-    std::string Decode(const std::vector<TokenId>& tokens) const override;
-
-    const std::unordered_map<std::string, TokenId>& GetVocabulary() const override;
-
-    bool SaveVocabulary(const std::string& file_path) const override;
-    bool LoadVocabulary(const std::string& file_path) override;
-
-private:
-    std::unordered_map<std::string, TokenId> vocab_;
-    std::unordered_map<TokenId, std::string> inverse_vocab_;
-};
-
-class WhitespaceTokenizer : public Tokenizer {
-public:
-    WhitespaceTokenizer(ParserMode parser_mode);
-
-    std::vector<TokenId> Encode(const std::string& text) const override;
-    std::string Decode(const std::vector<TokenId>& tokens) const override;
-
-    const std::unordered_map<std::string, TokenId>& GetVocabulary() const override;
-
-    bool SaveVocabulary(const std::string& file_path) const override;
-    bool LoadVocabulary(const std::string& file_path) override;
-
-private:
-    std::unordered_map<std::string, TokenId> vocab_;
-    std::unordered_map<TokenId, std::string> inverse_vocab_;
-};
-
-std::unique_ptr<Tokenizer> CreateTokenizer(
-    TokenizerMode mode,
-    ParserMode parser_mode = ParserMode::UTF_8
-);
+#pragma once
+#pragma once
+
+#include "Vocabulary.h"
+#include <atomic>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <optional>
+#include <unordered_set>
+#include <string_view>
+#include <functional>
+#include <stdexcept>
+
+struct ByteSet;
+
+enum class ParserMode { BYTES, UTF_8 };
+
+enum class TokenizerMode {
+    BPE,
+    WORD,
+    CHARACTER,
+    WHITESPACE,
+    LINE
+};
+
+class TokenInfo {
+public:
+    TokenInfo(TokenId id, const std::string& text);
+    TokenInfo(TokenId id, std::string_view text);
+
+    bool operator==(const TokenInfo& rhs) const;
+
+    TokenId GetId() const;
+    std::string_view GetText() const;
+
+private:
+    TokenId id_;
+    std::string text_;
+};
+
+// Thrown by Encode on text that is not valid UTF-8 in ParserMode::UTF_8,
+// offset is the first byte of the malformed sequence
+class Utf8Error : public std::runtime_error {
+public:
+    explicit Utf8Error(size_t offset, const std::string& source = "");
+
+    size_t Offset() const;
+
+private:
+    size_t offset_;
+};
+
+class Tokenizer {
+public:
+    Tokenizer(ParserMode parser_mode);
+    virtual ~Tokenizer() = default;
+
+    // Safe to call from several threads at once, they share one vocabulary
+    virtual std::vector<TokenId> Encode(std::string_view text) const = 0;
+    virtual std::string Decode(const std::vector<TokenId>& tokens) const = 0;
+    // Number of tokens Encode would produce, without growing the vocabulary;
+    // malformed UTF-8 is counted a byte at a time instead of rejected
+    virtual size_t CountTokens(std::string_view text) const = 0;
+    // Offset of the token after the first count tokens of text, split as
+    // CountTokens splits and found in one pass that stops there; the end of
+    // the text if it holds exactly count tokens, npos if fewer
+    virtual size_t SkipTokens(std::string_view text, size_t count) const = 0;
+    // Text of one token without copying it, valid until the vocabulary changes
+    virtual std::string_view TokenText(TokenId token) const;
+    // Appends the text of count tokens to out, same result as Decode
+    virtual void DecodeInto(const TokenId* tokens, size_t count, std::string& out) const;
+
+    virtual const Vocabulary& GetVocabulary() const;
+
+    virtual bool SaveVocabulary(const std::string& file_path) const = 0;
+    virtual bool LoadVocabulary(const std::string& file_path) = 0;
+
+    // Throws Utf8Error in ParserMode::UTF_8 if text is malformed, the check
+    // Encode makes for text that is never encoded
+    void CheckUtf8(std::string_view text) const;
+
+protected:
+    size_t CountUtf8Chars(std::string_view text) const;
+    size_t CountWords(std::string_view text) const;
+    size_t SkipUtf8Chars(std::string_view text, size_t count) const;
+
+    template <typename Fn>
+    void ForEachChar(std::string_view text, Fn&& fn) const;
+    template <typename Fn>
+    void ForEachWord(std::string_view text, Fn&& fn) const;
+    template <typename Fn>
+    void ForEachSplit(std::string_view text, const ByteSet& delimiters, bool keep_delimiters, Fn&& fn) const;
+    size_t CountSplits(std::string_view text, const ByteSet& delimiters, bool keep_delimiters) const;
+    size_t SkipSplits(std::string_view text, const ByteSet& delimiters, bool keep_delimiters, size_t count) const;
+    size_t CharLength(std::string_view text, size_t i) const;
+
+    ParserMode parser_mode_;
+    // Encode adds new tokens, the vocabulary is safe to grow from many threads
+    mutable Vocabulary vocab_;
+};
+
+struct WordCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Token ids of words BPE has already encoded, by the text of the word.
+// Holds a bounded number of words; when full, the one to replace is chosen
+// CLOCK-wise: a hand sweeps over the entries and takes the first one not
+// found again since the hand last passed it. Split into shards by hash,
+// each behind a mutex of its own, so any number of threads may look up and
+// add words at once. Clear and SetCapacity must not overlap with them
+class WordCache {
+public:
+    static constexpr size_t kDefaultCapacity = 1 << 16;
+    // Longer words rarely repeat and are not kept
+    static constexpr size_t kMaxWordLength = 64;
+
+    explicit WordCache(size_t capacity = kDefaultCapacity);
+
+    // Appends the ids of word to ids, false if the word is not cached
+    bool Find(std::string_view word, std::vector<TokenId>& ids);
+    void Add(std::string_view word, const TokenId* ids, size_t count);
+
+    // Drops all words, the counters keep counting
+    void Clear();
+    // Number of words kept, 0 turns the cache off
+    void SetCapacity(size_t capacity);
+    WordCacheStats GetStats() const;
+
+private:
+    struct Entry {
+        std::string word;
+        std::vector<TokenId> ids;
+        bool referenced = false;
+    };
+
+    // Entries are reserved up front and never move, the index keys are
+    // views of their words
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string_view, size_t> index;
+        std::vector<Entry> entries;
+        size_t hand = 0;
+    };
+
+    static constexpr size_t kShards = 16;
+
+    Shard& ShardOf(std::string_view word);
+
+    std::unique_ptr<Shard[]> shards_;
+    size_t shard_capacity_;
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+};
+
+class BPETokenizer : public Tokenizer {
+public:
+    BPETokenizer(ParserMode parser_mode);
+
+    std::vector<TokenId> Encode(std::string_view text) const override;
+    std::string Decode(const std::vector<TokenId>& tokens) const override;
+    size_t CountTokens(std::string_view text) const override;
+    size_t SkipTokens(std::string_view text, size_t count) const override;
+
+    bool SaveVocabulary(const std::string& file_path) const override;
+    bool LoadVocabulary(const std::string& file_path) override;
+
+    void Train(const std::vector<std::string>& corpus, int vocab_size, int min_frequency = 2);
+    void AddMerges(const std::vector<std::pair<std::string, std::string>>& merges);
+
+    // Words are encoded once and then taken from the cache
+    void SetCacheCapacity(size_t words);
+    WordCacheStats GetCacheStats() const;
+
+private:
+    mutable WordCache cache_;
+
+    std::vector<std::pair<std::string, std::string>> merges_;
+
+    // The merges by the ids their two sides have in symbols_. The rank of a
+    // merge is its place in merges_; a pair listed more than once is found
+    // at its first rank, the later ones are chained through later_rank_
+    struct MergeRule {
+        TokenId merged;
+        uint32_t rank;
+    };
+    static constexpr uint32_t kNoRank = std::numeric_limits<uint32_t>::max();
+
+    Vocabulary symbols_;
+    std::unordered_map<uint64_t, MergeRule> merge_rules_;
+    std::vector<uint32_t> later_rank_;
+
+    void IndexMerges();
+    void IndexMerge(uint32_t rank);
+    // Lowest rank of the pair that is at least min_rank, kNoRank if none
+    uint32_t FindMerge(TokenId first, TokenId second, uint32_t min_rank, TokenId& merged) const;
+
+    // Slices of word, one per token
+    std::vector<std::string_view> ApplyBPE(std::string_view word) const;
+    // Appends the ids of word to ids, through the cache
+    void EncodeWord(std::string_view word, TokenId unknown, std::vector<TokenId>& ids) const;
+};
+
+class CharacterTokenizer : public Tokenizer {
+public:
+    CharacterTokenizer(ParserMode parser_mode);
+
+    std::vector<TokenId> Encode(std::string_view text) const override;
+    std::string Decode(const std::vector<TokenId>& tokens) const override;
+    size_t CountTokens(std::string_view text) const override;
+    size_t SkipTokens(std::string_view text, size_t count) const override;
+
+    bool SaveVocabulary(const std::string& file_path) const override;
+    bool LoadVocabulary(const std::string& file_path) override;
+};
+
+class WordTokenizer : public Tokenizer {
+public:
+    WordTokenizer(ParserMode parser_mode);
+
+    std::vector<TokenId> Encode(std::string_view text) const override;
+    std::string Decode(const std::vector<TokenId>& tokens) const override;
+    size_t CountTokens(std::string_view text) const override;
+    size_t SkipTokens(std::string_view text, size_t count) const override;
+
+    bool SaveVocabulary(const std::string& file_path) const override;
+    bool LoadVocabulary(const std::string& file_path) override;
+};
+
+class WhitespaceTokenizer : public Tokenizer {
+public:
+    WhitespaceTokenizer(ParserMode parser_mode);
+
+    std::vector<TokenId> Encode(std::string_view text) const override;
+    std::string Decode(const std::vector<TokenId>& tokens) const override;
+    size_t CountTokens(std::string_view text) const override;
+    size_t SkipTokens(std::string_view text, size_t count) const override;
+    void DecodeInto(const TokenId* tokens, size_t count, std::string& out) const override;
+
+    bool SaveVocabulary(const std::string& file_path) const override;
+    bool LoadVocabulary(const std::string& file_path) override;
+};
+
+class LineTokenizer : public Tokenizer {
+public:
+    LineTokenizer(ParserMode parser_mode);
+
+    std::vector<TokenId> Encode(std::string_view text) const override;
+    std::string Decode(const std::vector<TokenId>& tokens) const override;
+    size_t CountTokens(std::string_view text) const override;
+    size_t SkipTokens(std::string_view text, size_t count) const override;
+
+    bool SaveVocabulary(const std::string& file_path) const override;
+    bool LoadVocabulary(const std::string& file_path) override;
+};
+
+std::unique_ptr<Tokenizer> CreateTokenizer(
+    TokenizerMode mode,
+    ParserMode parser_mode = ParserMode::UTF_8
+);
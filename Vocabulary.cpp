@@ -0,0 +1,265 @@
+#include "Vocabulary.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t kInitialSlots = 16;
+constexpr size_t kBlockSize = 1 << 16;
+
+// Eight bytes at a time, mixed by multiplication
+uint64_t HashText(std::string_view text) {
+    const uint64_t kMul = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = text.size() * kMul;
+
+    size_t i = 0;
+    for (; i + 8 <= text.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + i, 8);
+        hash = (hash ^ word) * kMul;
+        hash ^= hash >> 32;
+    }
+    // The last bytes are read in fixed-size pieces, overlapping if need be
+    const char* tail = text.data() + i;
+    size_t left = text.size() - i;
+    uint64_t rest = 0;
+    if (left >= 4) {
+        uint32_t first, last;
+        std::memcpy(&first, tail, 4);
+        std::memcpy(&last, tail + left - 4, 4);
+        rest = (static_cast<uint64_t>(first) << 32) | last;
+    }
+    else if (left > 0) {
+        rest = (static_cast<uint64_t>(static_cast<unsigned char>(tail[0])) << 16) |
+            (static_cast<uint64_t>(static_cast<unsigned char>(tail[left / 2])) << 8) |
+            static_cast<unsigned char>(tail[left - 1]);
+    }
+    hash = (hash ^ rest) * kMul;
+
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint32_t Tag(uint64_t hash) {
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+unsigned HighestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    unsigned bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+}
+
+Vocabulary::Vocabulary()
+    : shards_(new Shard[kShards]) {
+    for (auto& chunk : chunks_) {
+        chunk.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+Vocabulary::~Vocabulary() {
+    for (auto& chunk : chunks_) {
+        delete[] chunk.load(std::memory_order_relaxed);
+    }
+}
+
+// Shards are picked by the top bits, slots within one by the low bits
+Vocabulary::Shard& Vocabulary::ShardOf(uint64_t hash) const {
+    return shards_[hash >> 58];
+}
+
+const Vocabulary::Entry* Vocabulary::Probe(const Table& table, std::string_view text, uint64_t hash, size_t& slot) {
+    uint32_t tag = Tag(hash);
+    size_t i = hash & table.mask;
+    for (;;) {
+        const Entry* entry = table.slots[i].entry.load(std::memory_order_acquire);
+        if (entry == nullptr ||
+            (table.slots[i].tag.load(std::memory_order_relaxed) == tag && entry->text == text)) {
+            slot = i;
+            return entry;
+        }
+        i = (i + 1) & table.mask;
+    }
+}
+
+TokenId Vocabulary::Intern(std::string_view text) {
+    uint64_t hash = HashText(text);
+    Shard& shard = ShardOf(hash);
+    size_t slot;
+
+    const Table* table = shard.table.load(std::memory_order_acquire);
+    if (table != nullptr) {
+        if (const Entry* entry = Probe(*table, text, hash, slot)) {
+            return entry->id.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Another thread may have added the text or grown the table meanwhile
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    table = shard.table.load(std::memory_order_relaxed);
+    if (table != nullptr) {
+        if (const Entry* entry = Probe(*table, text, hash, slot)) {
+            return entry->id.load(std::memory_order_relaxed);
+        }
+    }
+    return Add(shard, text, hash, kNone);
+}
+
+void Vocabulary::Assign(std::string_view text, TokenId id) {
+    uint64_t hash = HashText(text);
+    Shard& shard = ShardOf(hash);
+    size_t slot;
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const Table* table = shard.table.load(std::memory_order_relaxed);
+    const Entry* found = (table != nullptr) ? Probe(*table, text, hash, slot) : nullptr;
+    if (found == nullptr) {
+        Add(shard, text, hash, id);
+        return;
+    }
+
+    Entry& entry = const_cast<Entry&>(*found);
+    entry.id.store(id, std::memory_order_relaxed);
+    SetText(id, entry.text);
+}
+
+TokenId Vocabulary::Find(std::string_view text) const {
+    uint64_t hash = HashText(text);
+    const Table* table = ShardOf(hash).table.load(std::memory_order_acquire);
+    size_t slot;
+    const Entry* entry = (table != nullptr) ? Probe(*table, text, hash, slot) : nullptr;
+    return (entry != nullptr) ? entry->id.load(std::memory_order_relaxed) : kNone;
+}
+
+bool Vocabulary::Contains(std::string_view text) const {
+    return Find(text) != kNone;
+}
+
+std::string_view Vocabulary::Text(TokenId id) const {
+    const std::string_view* text = TextSlot(id);
+    if (text != nullptr && text->data() != nullptr) {
+        return *text;
+    }
+    text = TextSlot(0);
+    if (text == nullptr || text->data() == nullptr) {
+        throw std::out_of_range("Vocabulary has no unknown token");
+    }
+    return *text;
+}
+
+size_t Vocabulary::Size() const {
+    return size_.load(std::memory_order_relaxed);
+}
+
+void Vocabulary::Clear() {
+    shards_.reset(new Shard[kShards]);
+    size_.store(0, std::memory_order_relaxed);
+
+    for (auto& chunk : chunks_) {
+        delete[] chunk.exchange(nullptr, std::memory_order_relaxed);
+    }
+    id_end_.store(0, std::memory_order_relaxed);
+}
+
+// Called with the shard locked. The entry and its text are complete before
+// the slot points to it, readers never see a half added text
+TokenId Vocabulary::Add(Shard& shard, std::string_view text, uint64_t hash, TokenId id) {
+    // At most three quarters full
+    const Table* table = shard.table.load(std::memory_order_relaxed);
+    if (table == nullptr || (shard.entries.size() + 1) * 4 > (table->mask + 1) * 3) {
+        Grow(shard);
+        table = shard.table.load(std::memory_order_relaxed);
+    }
+
+    size_.fetch_add(1, std::memory_order_relaxed);
+    if (id == kNone) {
+        // Past every id in use, ids given by Assign may leave holes below
+        id = static_cast<TokenId>(id_end_.fetch_add(1, std::memory_order_relaxed));
+    }
+
+    text = std::string_view(Store(shard, text), text.size());
+    const Entry& entry = shard.entries.emplace_back(text, hash, id);
+    SetText(id, text);
+
+    size_t slot;
+    Probe(*table, text, hash, slot);
+    table->slots[slot].tag.store(Tag(hash), std::memory_order_relaxed);
+    table->slots[slot].entry.store(&entry, std::memory_order_release);
+    return id;
+}
+
+void Vocabulary::Grow(Shard& shard) {
+    const Table* old = shard.table.load(std::memory_order_relaxed);
+    auto table = std::make_unique<Table>((old != nullptr) ? (old->mask + 1) * 2 : kInitialSlots);
+
+    for (const Entry& entry : shard.entries) {
+        size_t i = entry.hash & table->mask;
+        while (table->slots[i].entry.load(std::memory_order_relaxed) != nullptr) {
+            i = (i + 1) & table->mask;
+        }
+        table->slots[i].tag.store(Tag(entry.hash), std::memory_order_relaxed);
+        table->slots[i].entry.store(&entry, std::memory_order_relaxed);
+    }
+
+    shard.table.store(table.get(), std::memory_order_release);
+    shard.tables.push_back(std::move(table));
+}
+
+// Texts are laid out back to back in blocks, one longer than a block gets
+// a block of its own
+const char* Vocabulary::Store(Shard& shard, std::string_view text) {
+    if (text.empty()) {
+        return "";
+    }
+    if (shard.block_used + text.size() > shard.block_size) {
+        shard.block_size = std::max(kBlockSize, text.size());
+        shard.blocks.push_back(std::make_unique<char[]>(shard.block_size));
+        shard.block_used = 0;
+    }
+    char* stored = shard.blocks.back().get() + shard.block_used;
+    std::memcpy(stored, text.data(), text.size());
+    shard.block_used += text.size();
+    return stored;
+}
+
+// Chunk c holds the kFirstChunk << c ids after those of the chunks before it
+const std::string_view* Vocabulary::TextSlot(TokenId id) const {
+    uint64_t index = static_cast<uint64_t>(id) / kFirstChunk + 1;
+    unsigned chunk = HighestBit(index);
+    const std::string_view* texts = chunks_[chunk].load(std::memory_order_acquire);
+    if (texts == nullptr) {
+        return nullptr;
+    }
+    return texts + (id - kFirstChunk * ((uint64_t(1) << chunk) - 1));
+}
+
+void Vocabulary::SetText(TokenId id, std::string_view text) {
+    uint64_t index = static_cast<uint64_t>(id) / kFirstChunk + 1;
+    unsigned chunk = HighestBit(index);
+    std::string_view* texts = chunks_[chunk].load(std::memory_order_acquire);
+    if (texts == nullptr) {
+        std::lock_guard<std::mutex> lock(chunk_mutex_);
+        texts = chunks_[chunk].load(std::memory_order_relaxed);
+        if (texts == nullptr) {
+            texts = new std::string_view[kFirstChunk << chunk]();
+            chunks_[chunk].store(texts, std::memory_order_release);
+        }
+    }
+    texts[id - kFirstChunk * ((uint64_t(1) << chunk) - 1)] = text;
+
+    uint64_t end = id_end_.load(std::memory_order_relaxed);
+    while (end <= id && !id_end_.compare_exchange_weak(end, uint64_t(id) + 1, std::memory_order_relaxed)) {
+        // end holds the value another thread stored, retried if still smaller
+    }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+using TokenId = uint32_t;
+
+// Interned token texts shared by all tokenizers. Texts are copied once into
+// an arena that never moves, so views of them stay valid until Clear; ids
+// are found through an open addressing table that keeps part of every hash
+// next to the entry, so most mismatches cost no text compare, and texts
+// through a table indexed by id.
+//
+// Intern, Find and Text may be called from any number of threads at once:
+// the table is split into shards by hash, lookups take no lock and only
+// adding a text locks its shard. Ids of new texts are handed out in the
+// order they are added. Assign, Clear and ForEach must not overlap with
+// other calls
+class Vocabulary {
+public:
+    static constexpr TokenId kNone = std::numeric_limits<TokenId>::max();
+
+    Vocabulary();
+    ~Vocabulary();
+
+    Vocabulary(const Vocabulary&) = delete;
+    Vocabulary& operator=(const Vocabulary&) = delete;
+
+    // Id of text, a new text gets the id after the largest one in use
+    TokenId Intern(std::string_view text);
+    // Gives text the id, as read from a saved vocabulary
+    void Assign(std::string_view text, TokenId id);
+    // Id of text, kNone if it is not there
+    TokenId Find(std::string_view text) const;
+    bool Contains(std::string_view text) const;
+
+    // Text of id; ids without one get the text of id 0, the unknown token.
+    // Throws std::out_of_range if there is none either
+    std::string_view Text(TokenId id) const;
+
+    // Number of texts
+    size_t Size() const;
+    void Clear();
+
+    // Calls fn(text, id) for every id that has a text, in id order
+    template <typename Fn>
+    void ForEach(Fn&& fn) const {
+        TokenId end = static_cast<TokenId>(std::min<uint64_t>(id_end_.load(), kNone));
+        for (TokenId id = 0; id < end; id++) {
+            const std::string_view* text = TextSlot(id);
+            if (text != nullptr && text->data() != nullptr) {
+                fn(*text, id);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        Entry(std::string_view text, uint64_t hash, TokenId id)
+            : text(text), hash(hash), id(id) {
+        }
+
+        std::string_view text;
+        uint64_t hash;
+        std::atomic<TokenId> id;
+    };
+
+    // Readers see a slot's tag once its entry is set
+    struct Slot {
+        std::atomic<uint32_t> tag{ 0 };
+        std::atomic<const Entry*> entry{ nullptr };
+    };
+
+    struct Table {
+        explicit Table(size_t size)
+            : slots(new Slot[size]), mask(size - 1) {
+        }
+
+        std::unique_ptr<Slot[]> slots;
+        size_t mask;
+    };
+
+    // Tables are replaced when they fill up but kept until Clear, a reader
+    // may still be probing an old one; deque elements never move
+    struct Shard {
+        std::mutex mutex;
+        std::atomic<Table*> table{ nullptr };
+        std::vector<std::unique_ptr<Table>> tables;
+        std::deque<Entry> entries;
+
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t block_used = 0;
+        size_t block_size = 0;
+    };
+
+    static constexpr size_t kShards = 64;
+    // The id table grows in chunks that double in size and never move
+    static constexpr size_t kFirstChunk = 4096;
+    static constexpr size_t kChunks = 32;
+
+    Shard& ShardOf(uint64_t hash) const;
+    static const Entry* Probe(const Table& table, std::string_view text, uint64_t hash, size_t& slot);
+    TokenId Add(Shard& shard, std::string_view text, uint64_t hash, TokenId id);
+    static void Grow(Shard& shard);
+    static const char* Store(Shard& shard, std::string_view text);
+
+    const std::string_view* TextSlot(TokenId id) const;
+    void SetText(TokenId id, std::string_view text);
+
+    std::unique_ptr<Shard[]> shards_;
+    std::atomic<size_t> size_{ 0 };
+
+    std::atomic<std::string_view*> chunks_[kChunks];
+    std::mutex chunk_mutex_;
+    std::atomic<uint64_t> id_end_{ 0 }; // one past the largest id given out
+};
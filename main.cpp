@@ -1,61 +1,188 @@
-﻿#include "Tokenizer.h"
-#include "Diff.h"
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <memory>
-#include <string>
-
-std::string readFileToString(const std::string& fileName) {
-    std::ifstream file(fileName);
-    if (!file.is_open()) {
-        std::cerr << "Can't open file " << fileName << std::endl;
-        return "";
-    }
-
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
-}
-
-int main(int argc, char* argv[]) {
-    std::string oldFileName = "old.txt";
-    std::string newFileName = "new.txt";
-
-    if (argc == 2) {
-        oldFileName = argv[1];
-        newFileName = argv[2];
-    }
-    else if (argc < 2) {
-        std::cout << "Too few arguments" << std::endl;
-        std::cout << "Using default files: " << oldFileName << ", " << newFileName << std::endl;
-    }
-
-    std::string text1 = readFileToString(oldFileName);
-    std::string text2 = readFileToString(newFileName);
-
-    // Examples
-    //std::string text1 = "This is the first text to compare.\nIt contains several lines.\nSome will be changed.";
-    //std::string text2 = "This is the second text to compare.\nIt contains several lines with changes.\nA new line has been added.\nAnd one more line.";
-
-    if (text1.empty() || text2.empty()) {
-        std::cerr << "One of the files is empty or does not exist" << std::endl;
-        return 1;
-    }
-
-    // Create Tokenizer
-    auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
-
-    Diff diff(std::move(tokenizer), text1, text2, oldFileName, newFileName);
-
-    if (diff.Identical()) {
-        std::cout << "Texts are identical" << std::endl;
-        return 0;
-    }
-
-    // Output in Unified format
-    std::cout << "\nUnified diff format:" << std::endl;
-    std::cout << diff.GetDiff(DiffFormat::HISTOGRAM) << std::endl;
-
-    return 0;
-}
+﻿#include "Tokenizer.h"
+#include "Diff.h"
+#include "MappedFile.h"
+#include "Patch.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+
+std::string readFileToString(const std::string& fileName) {
+    std::ifstream file(fileName);
+    if (!file.is_open()) {
+        std::cerr << "Can't open file " << fileName << std::endl;
+        return "";
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+int main(int argc, char* argv[]) {
+    std::string oldFileName = "old.txt";
+    std::string newFileName = "new.txt";
+
+    DiffFormat format = DiffFormat::HISTOGRAM;
+    OutputFormat output = OutputFormat::UNIFIED;
+    std::string patchFileName;
+    bool stat = false;
+    bool refine = false;
+    RefineLevel refineLevel = RefineLevel::WORD;
+    DiffOptions options;
+
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--histogram") {
+            format = DiffFormat::HISTOGRAM;
+        }
+        else if (arg == "--patience") {
+            format = DiffFormat::PATIENCE;
+        }
+        else if (arg == "--myers") {
+            format = DiffFormat::MYERS;
+        }
+        else if (arg == "--refine" || arg == "--refine=word") {
+            refine = true;
+            refineLevel = RefineLevel::WORD;
+        }
+        else if (arg == "--refine=char") {
+            refine = true;
+            refineLevel = RefineLevel::CHARACTER;
+        }
+        else if (arg == "--stat") {
+            stat = true;
+        }
+        else if (arg == "--json") {
+            output = OutputFormat::NDJSON;
+        }
+        else if (arg == "--binary") {
+            output = OutputFormat::BINARY;
+        }
+        else if (arg.rfind("--threads=", 0) == 0) {
+            options.threads = std::max(1, std::atoi(arg.c_str() + 10));
+        }
+        else if (arg == "-U" && i + 1 < argc) {
+            options.context = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg.rfind("-U", 0) == 0 && arg.size() > 2) {
+            options.context = std::max(0, std::atoi(arg.c_str() + 2));
+        }
+        else if (arg.rfind("--apply=", 0) == 0) {
+            patchFileName = arg.substr(8);
+        }
+        else if (arg.rfind("--chunk=", 0) == 0) {
+            options.chunk_size = std::max(0, std::atoi(arg.c_str() + 8));
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+
+    if (stat && output != OutputFormat::UNIFIED) {
+        // Both replace the unified output, neither would be complete
+        std::cerr << "--stat can't be combined with --json or --binary" << std::endl;
+        return 1;
+    }
+
+    if (!patchFileName.empty()) {
+        // The second file is overwritten, so it is never a default and never
+        // the old file, which is read through a mapping while it is written
+        std::error_code error;
+        if (files.size() < 2) {
+            std::cerr << "--apply needs the old and the new file" << std::endl;
+            return 1;
+        }
+        if (files[0] == files[1] || std::filesystem::equivalent(files[0], files[1], error)) {
+            std::cerr << "--apply can't write the new file over the old one" << std::endl;
+            return 1;
+        }
+    }
+
+    if (files.size() >= 2) {
+        oldFileName = files[0];
+        newFileName = files[1];
+    }
+    else {
+        // Not part of the output, which may be records for other programs
+        std::cerr << "Too few arguments" << std::endl;
+        std::cerr << "Using default files: " << oldFileName << ", " << newFileName << std::endl;
+    }
+
+    if (!patchFileName.empty()) {
+        // Old file + patch -> new file, the second file is written
+        try {
+            MappedFile patchFile(patchFileName);
+            // Unified hunks are checked against the word tokens the diff was made of
+            auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+            Patch::Parse(patchFile.Data()).ApplyFile(oldFileName, newFileName, tokenizer.get());
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::string text1 = readFileToString(oldFileName);
+    std::string text2 = readFileToString(newFileName);
+
+    // Examples
+    //std::string text1 = "This is the first text to compare.\nIt contains several lines.\nSome will be changed.";
+    //std::string text2 = "This is the second text to compare.\nIt contains several lines with changes.\nA new line has been added.\nAnd one more line.";
+
+    if (text1.empty() || text2.empty()) {
+        std::cerr << "One of the files is empty or does not exist" << std::endl;
+        return 1;
+    }
+
+    // Create Tokenizer: refinement starts from whole lines
+    auto tokenizer = CreateTokenizer(refine ? TokenizerMode::LINE : TokenizerMode::WORD);
+
+    std::unique_ptr<Diff> diffPtr;
+    try {
+        diffPtr = std::make_unique<Diff>(std::move(tokenizer), text1, text2, oldFileName, newFileName, options);
+    }
+    catch (const Utf8Error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    Diff& diff = *diffPtr;
+
+    if (output != OutputFormat::UNIFIED) {
+        // Records for other programs, nothing else goes to stdout
+        return diff.WriteDiff(1, format, output) ? 0 : 1;
+    }
+
+    if (stat) {
+        // Counts only, nothing is rendered
+        DiffStats stats = diff.GetStats(format);
+        std::cout << stats.added << " tokens added, " << stats.removed << " removed, " << stats.kept << " kept" << std::endl;
+        return 0;
+    }
+
+    if (diff.Identical()) {
+        std::cout << "Texts are identical" << std::endl;
+        return 0;
+    }
+
+    if (refine) {
+        // Line diff with changed lines refined word by word
+        std::cout << "\nRefined diff format:" << std::endl;
+        std::cout << diff.GetRefinedDiff(format, refineLevel) << std::endl;
+        return 0;
+    }
+
+    // Output in Unified format
+    std::cout << "\nUnified diff format:" << std::endl;
+    // No blank line after it, the output can be applied with --apply as it is
+    diff.WriteDiff(std::cout, format);
+
+    return 0;
+}
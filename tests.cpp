@@ -3,9 +3,16 @@
 
 #include "Tokenizer.h"
 #include "Diff.h"
+#include "EditScript.h"
+#include "Patch.h"
+#include "ThreadPool.h"
 #include <memory>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 TEST_CASE("Character Tokenizer tests", "[tokenizer][character]") {
     auto tokenizer = CreateTokenizer(TokenizerMode::CHARACTER);
@@ -61,6 +68,314 @@ TEST_CASE("Tokenizer tests", "[tokenizer][word]") {
         REQUIRE(tokens.size() == 3);
         REQUIRE(tokenizer->Decode(tokens) == text);
     }
+    SECTION("Slices of a larger text") {
+        std::string text = "один два\r\nтри";
+        std::string_view middle = std::string_view(text).substr(0, 16);
+        auto tokens = tokenizer->Encode(middle);
+
+        REQUIRE(tokens.size() == 4);
+        REQUIRE(tokenizer->CountTokens(middle) == 4);
+        REQUIRE(tokenizer->Decode(tokens) == middle);
+        REQUIRE(tokenizer->Encode(text)[2] == tokens[2]);
+    }
+}
+
+TEST_CASE("Whitespace Tokenizer tests", "[tokenizer][whitespace]") {
+    auto tokenizer = CreateTokenizer(TokenizerMode::WHITESPACE);
+
+    SECTION("Runs of any whitespace separate tokens") {
+        auto tokens = tokenizer->Encode("  one\ttwo \r\n\v\fthree ");
+
+        REQUIRE(tokens.size() == 3);
+        REQUIRE(tokenizer->TokenText(tokens[2]) == "three");
+        REQUIRE(tokenizer->CountTokens("  one\ttwo \r\n\v\fthree ") == 3);
+    }
+
+    SECTION("Tokens across scanned blocks") {
+        std::string text;
+        for (int i = 0; i < 50; i++) {
+            text += std::string(i % 7 + 1, 'x') + std::string(i % 3 + 1, ' ');
+        }
+        auto tokens = tokenizer->Encode(text);
+
+        REQUIRE(tokens.size() == 50);
+        REQUIRE(tokenizer->CountTokens(text) == 50);
+        REQUIRE(CreateTokenizer(TokenizerMode::WORD)->CountTokens(text) == 149);
+    }
+}
+
+TEST_CASE("UTF-8 validation tests", "[tokenizer][utf8]") {
+    SECTION("Malformed input is rejected with its offset") {
+        std::string text = std::string(40, 'a') + "\xD0\xBF \xE2\x82 b";
+        for (TokenizerMode mode : { TokenizerMode::WORD, TokenizerMode::CHARACTER, TokenizerMode::WHITESPACE, TokenizerMode::LINE }) {
+            auto tokenizer = CreateTokenizer(mode);
+            try {
+                tokenizer->Encode(text);
+                FAIL("No Utf8Error");
+            }
+            catch (const Utf8Error& e) {
+                REQUIRE(e.Offset() == 43);
+            }
+        }
+    }
+
+    SECTION("Overlong forms, surrogates and cut off sequences") {
+        auto tokenizer = CreateTokenizer(TokenizerMode::CHARACTER);
+        REQUIRE_THROWS_AS(tokenizer->Encode("\xC0\xAF"), Utf8Error);
+        REQUIRE_THROWS_AS(tokenizer->Encode("a\xED\xA0\x80"), Utf8Error);
+        REQUIRE_THROWS_AS(tokenizer->Encode("\xF4\x90\x80\x80"), Utf8Error);
+        REQUIRE_THROWS_AS(tokenizer->Encode("ab\xF0\x9F\x98"), Utf8Error);
+        REQUIRE(tokenizer->Encode("\xF0\x9F\x98\x80\xEF\xBF\xBF").size() == 2);
+    }
+
+    SECTION("Counting and byte mode accept any input") {
+        auto tokenizer = CreateTokenizer(TokenizerMode::CHARACTER);
+        REQUIRE(tokenizer->CountTokens("a\xE2\x82") == 3);
+        REQUIRE(tokenizer->CountTokens("a\xE2\x82\xAC") == 2);
+
+        auto bytes = CreateTokenizer(TokenizerMode::CHARACTER, ParserMode::BYTES);
+        REQUIRE(bytes->Encode("\xFF\xFE").size() == 2);
+    }
+
+    SECTION("Diff reports the offset in the whole file") {
+        std::string text1 = "same\nline \xFF\n";
+        std::string text2 = "same\nline\n";
+        try {
+            Diff diff(CreateTokenizer(TokenizerMode::WORD), text1, text2, "a.txt", "b.txt");
+            FAIL("No Utf8Error");
+        }
+        catch (const Utf8Error& e) {
+            REQUIRE(e.Offset() == 10);
+            REQUIRE(std::string(e.what()).find("a.txt") == 0);
+        }
+    }
+
+    SECTION("Equal lines that are not tokenized are checked too") {
+        std::string text1 = "ok \xFF bad\nline\nx\n";
+        std::string text2 = "ok \xFF bad\nline\ny\n";
+        DiffOptions options;
+        options.context = 0;
+        for (const std::string* other : { &text2, &text1 }) {
+            try {
+                Diff diff(CreateTokenizer(TokenizerMode::WORD), text1, *other, "a.txt", "b.txt", options);
+                FAIL("No Utf8Error");
+            }
+            catch (const Utf8Error& e) {
+                REQUIRE(e.Offset() == 3);
+                REQUIRE(std::string(e.what()).find("a.txt") == 0);
+            }
+        }
+
+        std::string tail1 = "x\nsame \xFF\n";
+        std::string tail2 = "y\nsame \xFF\n";
+        REQUIRE_THROWS_AS(Diff(CreateTokenizer(TokenizerMode::WORD), tail1, tail2, "a.txt", "b.txt", options), Utf8Error);
+        Diff bytes(CreateTokenizer(TokenizerMode::WORD, ParserMode::BYTES), text1, text2);
+        REQUIRE_FALSE(bytes.GetEditScript().empty());
+    }
+}
+
+TEST_CASE("Line Tokenizer tests", "[tokenizer][line]") {
+    auto tokenizer = CreateTokenizer(TokenizerMode::LINE);
+
+    SECTION("Lines keep their line breaks") {
+        std::string text = "first line\nsecond line\nlast";
+        auto tokens = tokenizer->Encode(text);
+
+        REQUIRE(tokens.size() == 3);
+        REQUIRE(tokenizer->Decode({ tokens[0] }) == "first line\n");
+        REQUIRE(tokenizer->Decode(tokens) == text);
+    }
+
+    SECTION("Saved vocabulary keeps lines without a line break") {
+        auto tokens = tokenizer->Encode("first\tline\nlast-no-newline");
+        auto third = tokenizer->Encode("third\n");
+        REQUIRE(tokenizer->SaveVocabulary("test_lines.vocab"));
+
+        auto loaded = CreateTokenizer(TokenizerMode::LINE);
+        REQUIRE(loaded->LoadVocabulary("test_lines.vocab"));
+        std::remove("test_lines.vocab");
+
+        REQUIRE(loaded->Decode(tokens) == "first\tline\nlast-no-newline");
+        REQUIRE(loaded->Encode("third\n") == third);
+        auto added = loaded->Encode("new line\n");
+        REQUIRE(added[0] != third[0]);
+        REQUIRE(loaded->TokenText(third[0]) == "third\n");
+        REQUIRE(loaded->TokenText(added[0]) == "new line\n");
+    }
+}
+
+TEST_CASE("BPE Tokenizer tests", "[tokenizer][bpe]") {
+    BPETokenizer tokenizer(ParserMode::UTF_8);
+    auto texts = [&tokenizer](std::string_view text) {
+        std::vector<std::string_view> result;
+        for (TokenId token : tokenizer.Encode(text)) {
+            result.push_back(tokenizer.TokenText(token));
+        }
+        return result;
+    };
+
+    SECTION("Merges apply from the left without overlapping") {
+        tokenizer.AddMerges({ { "a", "a" } });
+
+        REQUIRE(texts("aaaaa") == std::vector<std::string_view>{ "aa", "aa", "a" });
+        REQUIRE(tokenizer.CountTokens("aaaaa") == 3);
+    }
+
+    SECTION("Merges apply in the order they were added") {
+        tokenizer.AddMerges({ { "b", "c" }, { "a", "bc" } });
+        REQUIRE(texts("abc") == std::vector<std::string_view>{ "abc" });
+
+        BPETokenizer reversed(ParserMode::UTF_8);
+        reversed.AddMerges({ { "a", "bc" }, { "b", "c" } });
+        REQUIRE(reversed.CountTokens("abc") == 2);
+    }
+
+    SECTION("A pair listed again merges pairs made after its first rank") {
+        tokenizer.AddMerges({ { "xy", "z" }, { "x", "y" } });
+        REQUIRE(texts("xyz") == std::vector<std::string_view>{ "xy", "z" });
+
+        tokenizer.AddMerges({ { "xy", "z" } });
+        REQUIRE(texts("xyz") == std::vector<std::string_view>{ "xyz" });
+    }
+
+    SECTION("Repeated words are encoded once") {
+        tokenizer.AddMerges({ { "a", "b" } });
+        auto tokens = tokenizer.Encode("ab ab ab");
+
+        REQUIRE(tokens.size() == 5);
+        REQUIRE(tokenizer.GetCacheStats().misses == 2);
+        REQUIRE(tokenizer.GetCacheStats().hits == 3);
+        REQUIRE(tokenizer.Encode("ab ab ab") == tokens);
+        REQUIRE(tokenizer.GetCacheStats().hits == 8);
+
+        // New merges are not hidden by words encoded before
+        REQUIRE(texts("bb") == std::vector<std::string_view>{ "b", "b" });
+        tokenizer.AddMerges({ { "b", "b" } });
+        REQUIRE(texts("bb") == std::vector<std::string_view>{ "bb" });
+    }
+
+    SECTION("Evicted words are encoded again the same way") {
+        tokenizer.AddMerges({ { "a", "b" }, { "ab", "c" } });
+        std::string text;
+        for (int i = 0; i < 200; i++) {
+            text += "abc" + std::to_string(i % 50) + " ";
+        }
+        auto tokens = tokenizer.Encode(text);
+
+        tokenizer.SetCacheCapacity(16);
+        REQUIRE(tokenizer.Encode(text) == tokens);
+        tokenizer.SetCacheCapacity(0);
+        REQUIRE(tokenizer.Encode(text) == tokens);
+        REQUIRE(tokenizer.CountTokens(text) == tokens.size());
+    }
+}
+
+TEST_CASE("Token text tests", "[tokenizer][text]") {
+    SECTION("Single tokens without copies") {
+        auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+        auto tokens = tokenizer->Encode("hello world");
+
+        REQUIRE(tokenizer->TokenText(tokens[0]) == "hello");
+        REQUIRE(tokenizer->TokenText(tokens[1]) == " ");
+    }
+
+    SECTION("Ranges decode like Decode") {
+        for (TokenizerMode mode : { TokenizerMode::WORD, TokenizerMode::CHARACTER, TokenizerMode::WHITESPACE, TokenizerMode::LINE }) {
+            auto tokenizer = CreateTokenizer(mode);
+            auto tokens = tokenizer->Encode("one two\nthree  four\n");
+
+            std::string text = "prefix ";
+            tokenizer->DecodeInto(tokens.data() + 1, tokens.size() - 1, text);
+            REQUIRE(text == "prefix " + tokenizer->Decode(std::vector<TokenId>(tokens.begin() + 1, tokens.end())));
+        }
+    }
+
+    SECTION("Skipped tokens end where the count says") {
+        std::string text;
+        for (int i = 0; i < 20; i++) {
+            text += "word\t\xC3\xA9t\xC3\xA9  \xE2\x82 x\n";
+        }
+        text += "  last";
+
+        for (TokenizerMode mode : { TokenizerMode::BPE, TokenizerMode::WORD, TokenizerMode::CHARACTER, TokenizerMode::WHITESPACE, TokenizerMode::LINE }) {
+            auto tokenizer = CreateTokenizer(mode);
+            size_t count = tokenizer->CountTokens(text);
+
+            for (size_t k = 0; k < count; k++) {
+                size_t offset = tokenizer->SkipTokens(text, k);
+                REQUIRE(offset < text.size());
+                REQUIRE(tokenizer->CountTokens(text.substr(0, offset)) == k);
+                REQUIRE(tokenizer->CountTokens(text.substr(0, offset + 1)) == k + 1);
+            }
+            REQUIRE(tokenizer->SkipTokens(text, count) == text.size());
+            REQUIRE(tokenizer->SkipTokens(text, count + 1) == std::string_view::npos);
+        }
+    }
+}
+
+TEST_CASE("Vocabulary tests", "[tokenizer][vocabulary]") {
+    Vocabulary vocab;
+
+    SECTION("Texts get consecutive ids once") {
+        REQUIRE(vocab.Intern("a") == 0);
+        REQUIRE(vocab.Intern("bb") == 1);
+        REQUIRE(vocab.Intern("a") == 0);
+        REQUIRE(vocab.Size() == 2);
+        REQUIRE(vocab.Find("bb") == 1);
+        REQUIRE(vocab.Find("c") == Vocabulary::kNone);
+    }
+
+    SECTION("Views stay valid while the table grows") {
+        std::vector<std::string_view> texts;
+        for (int i = 0; i < 100000; i++) {
+            texts.push_back(vocab.Text(vocab.Intern("token" + std::to_string(i))));
+        }
+
+        REQUIRE(vocab.Size() == 100000);
+        REQUIRE(texts[12345] == "token12345");
+        REQUIRE(vocab.Find("token99999") == 99999);
+        REQUIRE(vocab.Text(777) == "token777");
+    }
+
+    SECTION("Assigned ids and the unknown token") {
+        REQUIRE_THROWS_AS(vocab.Text(5), std::out_of_range);
+
+        vocab.Assign("<unk>", 0);
+        vocab.Assign("x", 7);
+        REQUIRE(vocab.Text(7) == "x");
+        REQUIRE(vocab.Text(3) == "<unk>");
+        REQUIRE(vocab.Text(100) == "<unk>");
+        // New ids never reuse one left out below an assigned id
+        REQUIRE(vocab.Intern("y") == 8);
+        REQUIRE(vocab.Text(7) == "x");
+
+        vocab.Clear();
+        REQUIRE(vocab.Size() == 0);
+        REQUIRE_FALSE(vocab.Contains("x"));
+    }
+
+    SECTION("Threads interning the same texts share their ids") {
+        std::vector<std::vector<TokenId>> ids(4);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < ids.size(); t++) {
+            threads.emplace_back([&vocab, &ids, t] {
+                for (int i = 0; i < 20000; i++) {
+                    ids[t].push_back(vocab.Intern("token" + std::to_string((i * 7 + t * 13) % 5000)));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        REQUIRE(vocab.Size() == 5000);
+        for (size_t t = 0; t < ids.size(); t++) {
+            for (int i = 0; i < 20000; i += 97) {
+                REQUIRE(ids[t][i] < 5000);
+                REQUIRE(vocab.Text(ids[t][i]) == "token" + std::to_string((i * 7 + t * 13) % 5000));
+            }
+        }
+    }
 }
 
 TEST_CASE("Diff tests", "[diff]") {
@@ -116,6 +431,243 @@ TEST_CASE("Diff tests", "[diff]") {
 
 }
 
+TEST_CASE("LCS tests", "[diff][lcs]") {
+    SECTION("Common subsequence in order") {
+        std::string text1 = "a b c d";
+        std::string text2 = "a c d e";
+
+        auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+        const Tokenizer& vocab = *tokenizer;
+        Diff diff(std::move(tokenizer), text1, text2);
+
+        REQUIRE(vocab.Decode(diff.LCS(DiffFormat::HISTOGRAM)) == "a c d");
+    }
+
+    SECTION("Patience keeps unique tokens as anchors") {
+        std::string text1 = "x a b c x";
+        std::string text2 = "b x a c x";
+
+        auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+        const Tokenizer& vocab = *tokenizer;
+        Diff diff(std::move(tokenizer), text1, text2);
+
+        REQUIRE(vocab.Decode(diff.LCS(DiffFormat::PATIENCE)) == "x a c x");
+    }
+
+    SECTION("Myers finds the longest subsequence") {
+        std::string text1 = "abcabba";
+        std::string text2 = "cbabac";
+
+        auto tokenizer = CreateTokenizer(TokenizerMode::CHARACTER);
+        Diff diff(std::move(tokenizer), text1, text2);
+
+        REQUIRE(diff.LCS(DiffFormat::MYERS).size() == 4);
+    }
+
+    SECTION("Histogram falls back to Myers on repetitive ranges") {
+        std::string text1 = "aabbaabbaabb";
+        std::string text2 = "ababababab";
+
+        DiffOptions options;
+        options.myers_fallback = 2;
+        Diff fallback(CreateTokenizer(TokenizerMode::CHARACTER), text1, text2, "old", "new", options);
+        Diff myers(CreateTokenizer(TokenizerMode::CHARACTER), text1, text2);
+
+        REQUIRE(fallback.LCS(DiffFormat::HISTOGRAM).size() == myers.LCS(DiffFormat::MYERS).size());
+    }
+
+    SECTION("Chain limit keeps common items out of the anchor search") {
+        DiffOptions options;
+        options.max_chain_length = 3;
+
+        Diff rare(CreateTokenizer(TokenizerMode::CHARACTER), "aaaaaaaab", "baaaaaaaa", "old", "new", options);
+        REQUIRE(rare.LCS(DiffFormat::HISTOGRAM).size() == 1);
+        REQUIRE(rare.GetStats().chain_limited == 1);
+        REQUIRE(rare.GetStats().myers_fallbacks == 0);
+
+        Diff common(CreateTokenizer(TokenizerMode::CHARACTER), "abababab", "babababa", "old", "new", options);
+        REQUIRE(common.LCS(DiffFormat::HISTOGRAM).size() == 7);
+        REQUIRE(common.GetStats().chain_limited == 2);
+        REQUIRE(common.GetStats().myers_fallbacks == 1);
+    }
+
+    SECTION("Long inputs do not exhaust the stack") {
+        std::string text1, text2;
+        for (int i = 0; i < 200000; i++) {
+            text1 += "line\n";
+            text2 += (i % 1000 == 0) ? "changed\n" : "line\n";
+        }
+
+        auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+        Diff diff(std::move(tokenizer), text1, text2);
+
+        auto lcs = diff.LCS(DiffFormat::HISTOGRAM);
+        REQUIRE(lcs.size() <= 400000 - 200);
+        REQUIRE(lcs.size() > 390000);
+    }
+}
+
+TEST_CASE("Edit script tests", "[diff][script]") {
+    std::string text1 = "x y x";
+    std::string text2 = "x z x";
+
+    auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+    Diff diff(std::move(tokenizer), text1, text2);
+
+    auto script = diff.GetEditScript(DiffFormat::HISTOGRAM);
+
+    std::string types;
+    for (const EditLine& line : script) {
+        types += line.type;
+    }
+    REQUIRE(types == "  -+  ");
+    REQUIRE(script[2].original_line == 2);
+    REQUIRE(script[2].modified_line == -1);
+    REQUIRE(script[3].original_line == -1);
+    REQUIRE(script[3].modified_line == 2);
+    REQUIRE(script[5].original_line == 4);
+    REQUIRE(script[5].modified_line == 4);
+}
+
+TEST_CASE("Diff statistics tests", "[diff][stats]") {
+    std::string text1 = "same\nsame\nold\nsame\ngone\nsame\n";
+    std::string text2 = "same\nsame\nnew\nsame\nsame\nadded\n";
+
+    for (DiffFormat format : { DiffFormat::HISTOGRAM, DiffFormat::PATIENCE, DiffFormat::MYERS }) {
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, text2);
+        DiffStats stats = diff.GetStats(format);
+
+        size_t added = 0, removed = 0, kept = 0;
+        for (const EditLine& line : diff.GetEditScript(format)) {
+            added += (line.type == '+');
+            removed += (line.type == '-');
+            kept += (line.type == ' ');
+        }
+        REQUIRE(stats.added == added);
+        REQUIRE(stats.removed == removed);
+        REQUIRE(stats.kept == kept);
+        REQUIRE(stats.kept == 4);
+    }
+}
+
+TEST_CASE("Identical input tests", "[diff][identical]") {
+    std::string text;
+    for (int i = 0; i < 1000; i++) {
+        text += "line" + std::to_string(i) + "\n";
+    }
+
+    auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+    const Tokenizer& vocab = *tokenizer;
+    size_t vocab_size = vocab.GetVocabulary().Size();
+    Diff diff(std::move(tokenizer), text, text);
+
+    SECTION("Nothing is tokenized") {
+        REQUIRE(diff.Identical());
+        REQUIRE(vocab.GetVocabulary().Size() == vocab_size);
+    }
+
+    SECTION("Results still cover the whole text") {
+        REQUIRE(diff.GetStats(DiffFormat::HISTOGRAM).kept == 2000);
+        REQUIRE(diff.LCS(DiffFormat::HISTOGRAM).size() == 2000);
+        REQUIRE(diff.GetDiff(DiffFormat::HISTOGRAM).find("@@") == std::string::npos);
+    }
+}
+
+TEST_CASE("Equal head and tail trimming tests", "[diff][trim]") {
+    std::string text1, text2;
+    for (int i = 0; i < 100; i++) {
+        text1 += "line" + std::to_string(i) + "\n";
+        text2 += (i == 50) ? "changed\n" : "line" + std::to_string(i) + "\n";
+    }
+
+    auto tokenizer = CreateTokenizer(TokenizerMode::WORD);
+    const Tokenizer& vocab = *tokenizer;
+    Diff diff(std::move(tokenizer), text1, text2);
+
+    SECTION("Equal lines are not tokenized") {
+        REQUIRE_FALSE(vocab.GetVocabulary().Contains("line10"));
+        REQUIRE_FALSE(vocab.GetVocabulary().Contains("line90"));
+    }
+
+    SECTION("Positions count the skipped tokens") {
+        auto script = diff.GetEditScript(DiffFormat::HISTOGRAM);
+        REQUIRE(script.size() == 201);
+
+        auto deleted = std::find_if(script.begin(), script.end(), [](const EditLine& line) { return line.type == '-'; });
+        REQUIRE(deleted != script.end());
+        REQUIRE(deleted->original_line == 100);
+        REQUIRE(vocab.Decode({ deleted->content }) == "line50");
+    }
+
+    SECTION("LCS includes the equal lines") {
+        REQUIRE(diff.LCS(DiffFormat::HISTOGRAM).size() == 199);
+    }
+}
+
+TEST_CASE("Thread pool tests", "[diff][parallel][pool]") {
+    SECTION("Wait covers tasks spawned by tasks") {
+        ThreadPool pool(4);
+        for (int round = 0; round < 50; round++) {
+            std::atomic<int> parents{ 0 };
+            std::atomic<int> children{ 0 };
+            for (int i = 0; i < 4; i++) {
+                pool.Submit([&pool, &parents, &children] {
+                    for (int k = 0; k < 8; k++) {
+                        pool.Submit([&children] { children++; });
+                    }
+                    // Children are done long before their parent
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    parents++;
+                });
+            }
+            pool.Wait();
+
+            REQUIRE(parents == 4);
+            REQUIRE(children == 32);
+        }
+    }
+}
+
+TEST_CASE("Parallel engine tests", "[diff][parallel]") {
+    std::string text1, text2;
+    for (int i = 0; i < 3000; i++) {
+        text1 += "item" + std::to_string(i % 97) + ((i % 7) ? " " : "\n");
+        text2 += (i % 101 == 0) ? "new " : "item" + std::to_string(i % 97) + ((i % 7) ? " " : "\n");
+    }
+
+    DiffOptions options;
+    options.threads = 4;
+    options.parallel_threshold = 16;
+
+    for (DiffFormat format : { DiffFormat::HISTOGRAM, DiffFormat::PATIENCE, DiffFormat::MYERS }) {
+        Diff sequential(CreateTokenizer(TokenizerMode::WORD), text1, text2);
+        Diff parallel(CreateTokenizer(TokenizerMode::WORD), text1, text2, "old", "new", options);
+
+        REQUIRE(parallel.GetDiff(format) == sequential.GetDiff(format));
+        REQUIRE(parallel.GetStats().ranges == sequential.GetStats().ranges);
+    }
+}
+
+TEST_CASE("Chunked diff tests", "[diff][chunk]") {
+    std::string text1, text2;
+    for (int i = 0; i < 2000; i++) {
+        text1 += "line" + std::to_string(i) + " common\n";
+        text2 += (i % 300 == 150) ? "changed common\n" : "line" + std::to_string(i) + " common\n";
+    }
+
+    for (int threads : { 1, 4 }) {
+        DiffOptions options;
+        options.chunk_size = 200;
+        options.threads = threads;
+
+        Diff chunked(CreateTokenizer(TokenizerMode::WORD), text1, text2, "old", "new", options);
+        Diff whole(CreateTokenizer(TokenizerMode::WORD), text1, text2);
+
+        REQUIRE(chunked.GetDiff(DiffFormat::HISTOGRAM) == whole.GetDiff(DiffFormat::HISTOGRAM));
+        REQUIRE(chunked.GetStats().ranges > whole.GetStats().ranges);
+    }
+}
+
 TEST_CASE("Diff format output tests", "[diff][format]") {
     std::string text1 = "line1\nline2\nline3\n";
     std::string text2 = "line1\nmodified line\nline3\n";
@@ -130,6 +682,316 @@ TEST_CASE("Diff format output tests", "[diff][format]") {
         REQUIRE(unified_diff.find("+++") != std::string::npos);
         REQUIRE(unified_diff.find("@@") != std::string::npos);
     }
+
+    SECTION("Streamed output matches the string output") {
+        std::ostringstream out;
+        diff.WriteDiff(out, DiffFormat::HISTOGRAM);
+        REQUIRE(out.str() == diff.GetDiff(DiffFormat::HISTOGRAM));
+    }
+
+    SECTION("NDJSON format") {
+        Diff json(CreateTokenizer(TokenizerMode::LINE), "same\nsay \"hi\"\tnow\nsame\n", "same\nbye\nsame\n");
+        std::string records = json.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::NDJSON);
+
+        REQUIRE(records ==
+            "{\"from\":{\"start\":1,\"count\":3},\"to\":{\"start\":1,\"count\":3},\"ops\":["
+            "{\"op\":\"context\",\"text\":\"same\\n\"},"
+            "{\"op\":\"delete\",\"text\":\"say \\\"hi\\\"\\tnow\\n\"},"
+            "{\"op\":\"insert\",\"text\":\"bye\\n\"},"
+            "{\"op\":\"context\",\"text\":\"same\\n\"}]}\n");
+    }
+
+    SECTION("NDJSON of byte tokens is valid UTF-8") {
+        std::string text1 = "caf\xC3\xA9 \xFF\nsame\n";
+        std::string text2 = "cafe \xFF!\nsame\n";
+        DiffOptions options;
+        options.context = 100;
+        Diff bytes(CreateTokenizer(TokenizerMode::CHARACTER, ParserMode::BYTES), text1, text2, "old", "new", options);
+        std::string records = bytes.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::NDJSON);
+
+        // Strings of the records, \u00XX read back as the byte it stands for
+        auto read_string = [](const std::string& line, size_t& i) {
+            std::string value;
+            while (line[i] != '"') {
+                REQUIRE(static_cast<unsigned char>(line[i]) >= 0x20);
+                if (line[i] != '\\') {
+                    value += line[i++];
+                    continue;
+                }
+                char escape = line[i + 1];
+                i += 2;
+                if (escape == 'u') {
+                    value += static_cast<char>(std::stoi(line.substr(i, 4), nullptr, 16));
+                    i += 4;
+                }
+                else {
+                    value += (escape == 'n') ? '\n' : (escape == 't') ? '\t' : (escape == 'r') ? '\r' : escape;
+                }
+            }
+            i++;
+            return value;
+        };
+
+        auto utf8 = CreateTokenizer(TokenizerMode::CHARACTER);
+        std::istringstream lines(records);
+        std::string line, from, to;
+        while (std::getline(lines, line)) {
+            REQUIRE_NOTHROW(utf8->Encode(line));
+            REQUIRE(line.front() == '{');
+            REQUIRE(line.back() == '}');
+
+            for (size_t i = line.find("\"op\":\""); i != std::string::npos; i = line.find("\"op\":\"", i)) {
+                i += 6;
+                std::string op = read_string(line, i);
+                i = line.find("\"text\":\"", i) + 8;
+                std::string text = read_string(line, i);
+                if (op != "insert") {
+                    from += text;
+                }
+                if (op != "delete") {
+                    to += text;
+                }
+            }
+        }
+
+        REQUIRE(from == text1);
+        REQUIRE(to == text2);
+    }
+
+    SECTION("Output larger than the write buffer") {
+        std::string big1, big2;
+        for (int i = 0; i < 20000; i++) {
+            big1 += "line" + std::to_string(i) + "\n";
+            big2 += "line" + std::to_string(i % 3 == 0 ? -i : i) + "\n";
+        }
+        Diff big(CreateTokenizer(TokenizerMode::LINE), big1, big2);
+
+        std::ostringstream out;
+        big.WriteDiff(out, DiffFormat::HISTOGRAM);
+        REQUIRE(out.str().size() > (1 << 16));
+        REQUIRE(out.str() == big.GetDiff(DiffFormat::HISTOGRAM));
+    }
+}
+
+TEST_CASE("Hunk context tests", "[diff][format][context]") {
+    auto hunks = [](const std::string& text1, const std::string& text2, int context) {
+        DiffOptions options;
+        options.context = context;
+        Diff diff(CreateTokenizer(TokenizerMode::CHARACTER), text1, text2, "old", "new", options);
+        std::string unified = diff.GetDiff(DiffFormat::HISTOGRAM);
+
+        std::vector<std::string> headers;
+        for (size_t pos = unified.find("@@ -"); pos != std::string::npos; pos = unified.find("@@ -", pos + 1)) {
+            headers.push_back(unified.substr(pos, unified.find('\n', pos) - pos));
+        }
+        return headers;
+    };
+
+    SECTION("Headers use 1-based starts") {
+        REQUIRE(hunks("abcdefgh", "abcXefgh", 1) == std::vector<std::string>{ "@@ -3,3 +3,3 @@" });
+        REQUIRE(hunks("abcdefgh", "abcXefgh", 0) == std::vector<std::string>{ "@@ -4,1 +4,1 @@" });
+    }
+
+    SECTION("Empty side starts at the token before it") {
+        REQUIRE(hunks("abcdef", "abcXdef", 0) == std::vector<std::string>{ "@@ -3,0 +4,1 @@" });
+        REQUIRE(hunks("abcXdef", "abcdef", 0) == std::vector<std::string>{ "@@ -4,1 +3,0 @@" });
+    }
+
+    SECTION("Context is limited by the text bounds") {
+        REQUIRE(hunks("abcdef", "Xbcdef", 3) == std::vector<std::string>{ "@@ -1,4 +1,4 @@" });
+        REQUIRE(hunks("abcdef", "abcdeX", 3) == std::vector<std::string>{ "@@ -3,4 +3,4 @@" });
+    }
+
+    SECTION("Changes with overlapping context share a hunk") {
+        REQUIRE(hunks("abcdefghij", "aXcdefgYij", 2) == std::vector<std::string>{ "@@ -1,4 +1,4 @@", "@@ -6,5 +6,5 @@" });
+        REQUIRE(hunks("abcdefghij", "aXcdefgYij", 3) == std::vector<std::string>{ "@@ -1,10 +1,10 @@" });
+        // Windows that only touch are merged too
+        REQUIRE(hunks("abcdef", "aXcdYf", 1) == std::vector<std::string>{ "@@ -1,6 +1,6 @@" });
+    }
+}
+
+TEST_CASE("Binary edit script tests", "[diff][binary]") {
+    std::string text1 = "keep this\nold line\nkeep that\nand this\n";
+    std::string text2 = "keep this\nnew line\nkeep that\nand this\nadded\n";
+
+    Diff diff(CreateTokenizer(TokenizerMode::WORD), text1, text2);
+    std::string script = diff.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::BINARY);
+
+    SECTION("Runs rebuild the new text from the old one") {
+        EditScriptReader reader(script);
+        REQUIRE(reader.GetVersion() == 1);
+        REQUIRE(reader.HasText());
+
+        std::string rebuilt;
+        size_t offset = 0;
+        uint64_t from_tokens = 0, to_tokens = 0;
+        EditOp op;
+        while (reader.Next(op)) {
+            REQUIRE(op.from_pos == from_tokens);
+            REQUIRE(op.to_pos == to_tokens);
+            if (op.kind == EditKind::COPY) {
+                rebuilt += text1.substr(offset, op.bytes);
+            }
+            if (op.kind == EditKind::INSERT) {
+                rebuilt += op.text;
+            }
+            else {
+                offset += op.bytes;
+                from_tokens += op.tokens;
+            }
+            if (op.kind != EditKind::DELETE) {
+                to_tokens += op.tokens;
+            }
+        }
+
+        REQUIRE(rebuilt == text2);
+        REQUIRE(offset == text1.size());
+        REQUIRE(from_tokens == reader.FromTokens());
+        REQUIRE(to_tokens == reader.ToTokens());
+    }
+
+    SECTION("Adjacent runs are merged") {
+        EditScriptReader reader(script);
+        EditOp op, prev;
+        bool first = true;
+        while (reader.Next(op)) {
+            REQUIRE((first || op.kind != prev.kind));
+            prev = op;
+            first = false;
+        }
+    }
+
+    SECTION("Scripts without text") {
+        DiffOptions options;
+        options.script_text = false;
+        Diff bare(CreateTokenizer(TokenizerMode::WORD), text1, text2, "old", "new", options);
+        std::string small = bare.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::BINARY);
+
+        EditScriptReader reader(small);
+        REQUIRE_FALSE(reader.HasText());
+        REQUIRE(small.size() < script.size());
+        REQUIRE(reader.OpCount() == EditScriptReader(script).OpCount());
+    }
+
+    SECTION("Damaged scripts are rejected") {
+        REQUIRE_THROWS_AS(EditScriptReader(std::string_view("not a script")), std::runtime_error);
+        REQUIRE_THROWS_AS(EditScriptReader(std::string_view(script).substr(0, script.size() - 1)), std::runtime_error);
+    }
+
+    SECTION("Scripts are read from mapped files") {
+        {
+            std::ofstream file("test_script.bin", std::ios::binary);
+            file << script;
+        }
+        EditScriptReader reader = EditScriptReader::Open("test_script.bin");
+        REQUIRE(reader.OpCount() == EditScriptReader(script).OpCount());
+
+        EditOp op;
+        size_t inserted = 0;
+        while (reader.Next(op)) {
+            inserted += op.text.size();
+        }
+        REQUIRE(inserted > 0);
+
+        std::remove("test_script.bin");
+    }
+}
+
+TEST_CASE("Patch tests", "[patch]") {
+    std::string text1, text2;
+    for (int i = 0; i < 300; i++) {
+        text1 += "x = " + std::to_string(i % 7) + ";\n";
+        text2 += (i % 50 == 10) ? "y = 0;\n" : "x = " + std::to_string(i % 7) + ";\n";
+    }
+    text2 += "end\n";
+
+    SECTION("Unified diffs are applied at their token positions") {
+        for (TokenizerMode mode : { TokenizerMode::WORD, TokenizerMode::CHARACTER, TokenizerMode::LINE }) {
+            Diff diff(CreateTokenizer(mode), text1, text2);
+            Patch patch = Patch::Parse(diff.GetDiff(DiffFormat::HISTOGRAM));
+
+            auto tokenizer = CreateTokenizer(mode);
+            REQUIRE(patch.Apply(text1, tokenizer.get()) == text2);
+        }
+    }
+
+    SECTION("Insertions without context are placed by token position") {
+        std::string inserted = "top\n";
+        for (int i = 0; i < 300; i++) {
+            inserted += "x = " + std::to_string(i % 7) + ";\n";
+            if (i % 60 == 30) {
+                inserted += "z = 1;\n";
+            }
+        }
+        inserted += "end\n";
+
+        DiffOptions options;
+        options.context = 0;
+        for (TokenizerMode mode : { TokenizerMode::WORD, TokenizerMode::CHARACTER, TokenizerMode::LINE }) {
+            for (const std::string* target : { &text2, &inserted }) {
+                Diff diff(CreateTokenizer(mode), text1, *target, "old", "new", options);
+                Patch patch = Patch::Parse(diff.GetDiff(DiffFormat::HISTOGRAM));
+
+                auto tokenizer = CreateTokenizer(mode);
+                REQUIRE(patch.Apply(text1, tokenizer.get()) == *target);
+            }
+        }
+
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, inserted, "old", "new", options);
+        REQUIRE_THROWS_AS(Patch::Parse(diff.GetDiff(DiffFormat::HISTOGRAM)).Apply(text1), std::runtime_error);
+    }
+
+    SECTION("Binary scripts are applied exactly") {
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, text2);
+        Patch patch = Patch::Parse(diff.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::BINARY));
+
+        REQUIRE(patch.EditCount() == 7);
+        REQUIRE(patch.Apply(text1) == text2);
+        REQUIRE_THROWS_AS(patch.Apply(text1 + "more"), std::runtime_error);
+    }
+
+    SECTION("Files are patched through a mapping") {
+        {
+            std::ofstream file("test_patch_old.txt", std::ios::binary);
+            file << text1;
+        }
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, text2);
+        Patch::Parse(diff.GetDiff(DiffFormat::HISTOGRAM, OutputFormat::BINARY)).ApplyFile("test_patch_old.txt", "test_patch_new.txt");
+
+        std::ifstream result("test_patch_new.txt", std::ios::binary);
+        std::stringstream contents;
+        contents << result.rdbuf();
+        REQUIRE(contents.str() == text2);
+
+        std::remove("test_patch_old.txt");
+        std::remove("test_patch_new.txt");
+    }
+
+    SECTION("Malformed and mismatching patches are rejected") {
+        REQUIRE_THROWS_AS(Patch::Parse("no diff here\n"), std::runtime_error);
+        REQUIRE_THROWS_AS(Patch::Parse("--- a\n+++ b\n@@ -1,2 +1,1 @@\n-x\n"), std::runtime_error);
+        REQUIRE_THROWS_AS(Patch::Parse("--- a\n+++ b\n@@ -1,1 +1,1 @@\n-x\n+y\n").Apply("z"), std::runtime_error);
+    }
+}
+
+TEST_CASE("Refined diff tests", "[diff][refine]") {
+    std::string text1 = "line1\nhello world\nline3\n";
+    std::string text2 = "line1\nhallo world\nline3\n";
+
+    SECTION("Word refinement") {
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, text2);
+        std::string refined = diff.GetRefinedDiff(DiffFormat::HISTOGRAM, RefineLevel::WORD);
+
+        REQUIRE(refined.find("@@ -1,3 +1,3 @@") != std::string::npos);
+        REQUIRE(refined.find("![-hello-]{+hallo+} world") != std::string::npos);
+    }
+
+    SECTION("Character refinement") {
+        Diff diff(CreateTokenizer(TokenizerMode::LINE), text1, text2);
+        std::string refined = diff.GetRefinedDiff(DiffFormat::HISTOGRAM, RefineLevel::CHARACTER);
+
+        REQUIRE(refined.find("!h[-e-]{+a+}llo world") != std::string::npos);
+    }
 }
 
 TEST_CASE("File comparison integration tests", "[integration]") {